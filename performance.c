@@ -1,27 +1,52 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
 #include <sys/wait.h>
-#include <sys/time.h>
 #include <time.h>
 #include <fcntl.h>
+#include "scan.h"
 
 #define NUM_ITERATIONS 100
+#define NUM_WARMUP 5
 #define COMMAND_SIZE 1024
 #define OUTPUT_FILE "benchmark.txt"
 #define PROGRESS_BAR_WIDTH 50
+#define SCAN_LINE_SIZE (1 << 20)
+#define SCAN_PASSES 200
+#define MAX_TESTS 32
+#define DEFAULT_THRESHOLD 10.0
+
+// Set from the command line, see usage()
+int iterations = NUM_ITERATIONS;
+int warmup = NUM_WARMUP;
+int runner_cpu = -1;    // -1: not pinned
+int shell_cpu = -1;     // CPU the measured shell (and everything it starts) is pinned to
+const char* qish_path = "./shell";
+
+// Summary of one test's samples, all in ms
+struct Stats {
+    double mean;
+    double ci95;        // Half width of the 95% confidence interval of the mean
+    double min, p50, p90, p99, max;
+    int outliers;       // Samples outside the 1.5 IQR fences, left in: the percentiles already shrug them off
+};
+
+struct TestResult {
+    const char* name;
+    const char* command;
+    struct Stats stats;
+    int status;         // Exit status of the test, used as the reference for the next shell
+};
 
 // Store all results in a struct
+// tests[0..NUM_BASIC_TESTS) are the basic tests, the rest the external_tests in order
 struct BenchmarkResults {
-    double parallel_time;
-    double redirection_time;
-    double builtin_time;
-    struct {
-        const char* name;
-        double time;
-    } external_times[20];
-    int num_external;
+    struct TestResult tests[MAX_TESTS];
+    int num_tests;
     double external_avg;
     double overall_avg;
 };
@@ -40,17 +65,27 @@ void print_progress(const char* shell_name, const char* test_name, int current,
     fflush(stdout);
 }
 
-long get_microseconds() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
+// now_ms - CLOCK_MONOTONIC in ms. gettimeofday is wall time: an NTP step in the middle of a run lands in a sample.
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-double measure_command(const char* shell, const char* command) {
-    long start, end;
+// pin_to_cpu - pid 0 is the calling process, children inherit the mask
+int pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// measure_command - runs `shell -c command` once, returns the wall time in ms and stores the shell's exit status
+double measure_command(const char* shell, const char* command, int* exit_status) {
+    double start, end;
     int status;
     
-    start = get_microseconds();
+    start = now_ms();
     
     pid_t pid = fork();
     if (pid == 0) {
@@ -58,156 +93,596 @@ double measure_command(const char* shell, const char* command) {
         dup2(devnull, STDOUT_FILENO);
         dup2(devnull, STDERR_FILENO);
         close(devnull);
+        if (shell_cpu >= 0 && shell_cpu != runner_cpu) {
+            pin_to_cpu(shell_cpu);
+        }
         execlp(shell, shell, "-c", command, NULL);
         exit(1);
     }
     
     waitpid(pid, &status, 0);
-    end = get_microseconds();
+    end = now_ms();
     
-    return (end - start) / 1000.0;
+    *exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return end - start;
 }
 
-double measure_parallel_commands(const char* shell) {
-    const char* command = (strcmp(shell, "./qish") == 0) ?
-        "sleep 0.1 & sleep 0.1 & sleep 0.1" :
-        "sleep 0.1 & sleep 0.1 & sleep 0.1 & wait";
-    return measure_command(shell, command);
+// check_status - the timing means nothing if the shell didn't actually run the command.
+// The first shell benchmarked (bash) is the reference: every run of the next shell has to exit the same way.
+void check_status(const char* shell_name, const char* command, int status, int expected) {
+    if (status != expected) {
+        fprintf(stderr, "\n%s: \"%s\" exited with %d (expected %d), results would be meaningless\n",
+                shell_name, command, status, expected);
+        exit(1);
+    }
 }
 
-double measure_redirection(const char* shell) {
-    return measure_command(shell, "echo test > /dev/null");
+// run_step - untimed setup / cleanup around a test
+void run_step(const char* shell, const char* command) {
+    int status;
+    if (command != NULL) {
+        measure_command(shell, command, &status);
+    }
 }
 
-double measure_builtin(const char* shell) {
-    return measure_command(shell, "cd .");
+const char* parallel_command(const char* shell) {
+    return (strcmp(shell, qish_path) == 0) ?
+        "sleep 0.1 & sleep 0.1 & sleep 0.1" :
+        "sleep 0.1 & sleep 0.1 & sleep 0.1 & wait";
 }
+#define REDIRECTION_COMMAND "echo test > /dev/null"
+#define BUILTIN_COMMAND "cd ."
+#define NUM_BASIC_TESTS 3
 
 // Test definitions
+// setup / cleanup run untimed around every iteration so each iteration sees the same state
 struct CommandTest {
     const char* name;
     const char* command;
+    const char* setup;
+    const char* cleanup;
 } external_tests[] = {
-    {"Simple directory listing (ls)", "ls"},
-    {"File Content Analysis (wc shell.c)", "wc shell.c"},
-    {"File Content Viewing (more shell.c)", "more shell.c"},
-    {"File Comparison (diff shell.c performance.c)", "diff shell.c performance.c"},
-    {"Directory Creation (mkdir TEST)", "mkdir TEST"},
-    {"Directory Removal (rmdir TEST)", "rmdir TEST"},
-    {"Recursive directory traversal (ls -R /etc)", "ls -R /etc"},
-    {"Process Information - Heavy system call (ps aux)", "ps aux"},
-    {"System information (uname -a)", "uname -a"},
-    {"Directory listing with pipe and counting (ls -1 /etc | wc -l)", "ls -1 /etc | wc -l"},
-    {"sort unique with output (cat shell.c | sort | uniq > uniq.txt)", "cat shell.c | sort | uniq > uniq.txt"},
-    {"remove test file, if exists (rm -f uniq.txt)", "rm -f uniq.txt"},
-    {NULL, NULL}
+    {"Simple directory listing (ls)", "ls", NULL, NULL},
+    {"File Content Analysis (wc shell.c)", "wc shell.c", NULL, NULL},
+    {"File Content Viewing (more shell.c)", "more shell.c", NULL, NULL},
+    {"File Comparison (diff shell.c performance.c)", "diff shell.c performance.c", NULL, NULL},
+    {"Directory Creation (mkdir TEST)", "mkdir TEST", NULL, "rmdir TEST"},
+    {"Directory Removal (rmdir TEST)", "rmdir TEST", "mkdir TEST", NULL},
+    {"Recursive directory traversal (ls -R /etc)", "ls -R /etc", NULL, NULL},
+    {"Process Information - Heavy system call (ps aux)", "ps aux", NULL, NULL},
+    {"System information (uname -a)", "uname -a", NULL, NULL},
+    {"Directory listing with pipe and counting (ls -1 /etc | wc -l)", "ls -1 /etc | wc -l", NULL, NULL},
+    {"sort unique with output (cat shell.c | sort | uniq > uniq.txt)", "cat shell.c | sort | uniq > uniq.txt", NULL, NULL},
+    {"remove test file, if exists (rm -f uniq.txt)", "rm -f uniq.txt", NULL, NULL},
+    {NULL, NULL, NULL, NULL}
 };
 
-struct BenchmarkResults run_benchmarks(const char* shell_name, const char* shell_path) {
+int compare_samples(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// percentile - the nearest-rank p-th percentile of count sorted values
+double percentile(const double* sorted, int count, int p) {
+    int rank = (p * count + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// square_root - Newton's method, so this still builds without -lm
+double square_root(double value) {
+    if (value <= 0) {
+        return 0;
+    }
+    double root = value > 1 ? value : 1;
+    for (int i = 0; i < 64; i++) {
+        root = (root + value / root) / 2;
+    }
+    return root;
+}
+
+// summarize - sorts the samples in place. The CI uses the normal approximation, fine from a few dozen samples up.
+struct Stats summarize(double* samples, int count) {
+    struct Stats stats = {0};
+    double sum = 0, squares = 0;
+    qsort(samples, count, sizeof(double), compare_samples);
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    stats.mean = sum / count;
+    for (int i = 0; i < count; i++) {
+        squares += (samples[i] - stats.mean) * (samples[i] - stats.mean);
+    }
+    double deviation = count > 1 ? square_root(squares / (count - 1)) : 0;
+    stats.ci95 = 1.96 * deviation / square_root(count);
+    stats.min = samples[0];
+    stats.p50 = percentile(samples, count, 50);
+    stats.p90 = percentile(samples, count, 90);
+    stats.p99 = percentile(samples, count, 99);
+    stats.max = samples[count - 1];
+    double p25 = percentile(samples, count, 25);
+    double p75 = percentile(samples, count, 75);
+    for (int i = 0; i < count; i++) {
+        if (samples[i] < p25 - 1.5 * (p75 - p25) || samples[i] > p75 + 1.5 * (p75 - p25)) {
+            stats.outliers++;
+        }
+    }
+    return stats;
+}
+
+// measure_test - warmup runs, then the timed ones. Both check the exit status against the reference (-1: none).
+struct TestResult measure_test(const char* shell_name, const char* shell_path, const char* name, const char* command,
+                               const struct CommandTest* steps, int expected, double* samples, int* progress, int total) {
+    struct TestResult result = {.name = name, .command = command};
+    for (int i = 0; i < warmup + iterations; i++) {
+        int status;
+        if (steps != NULL) {
+            run_step(shell_path, steps->setup);
+        }
+        double time = measure_command(shell_path, command, &status);
+        if (steps != NULL) {
+            run_step(shell_path, steps->cleanup);
+        }
+        if (expected >= 0) {
+            check_status(shell_name, command, status, expected);
+        }
+        if (i >= warmup) {
+            samples[i - warmup] = time;
+        }
+        result.status = status;
+        print_progress(shell_name, name, ++*progress, total);
+    }
+    result.stats = summarize(samples, iterations);
+    return result;
+}
+
+// run_benchmarks - reference is the previous shell's results (NULL for the first shell), see check_status
+struct BenchmarkResults run_benchmarks(const char* shell_name, const char* shell_path, const struct BenchmarkResults* reference) {
     struct BenchmarkResults results = {0};
-    double total_parallel = 0, total_redirection = 0, total_builtin = 0;
-    int total_tests = NUM_ITERATIONS * (3 + 10);
+    struct {
+        const char* name;
+        const char* command;
+    } basic_tests[NUM_BASIC_TESTS] = {
+        {"Parallel execution time", parallel_command(shell_path)},
+        {"Redirection time", REDIRECTION_COMMAND},
+        {"Built-in command time", BUILTIN_COMMAND},
+    };
+    int num_external = 0;
+    while (external_tests[num_external].command != NULL) {
+        num_external++;
+    }
+    int total_tests = (warmup + iterations) * (NUM_BASIC_TESTS + num_external);
     int current_test = 0;
-    
-    // Basic tests
-    for (int i = 0; i < NUM_ITERATIONS; i++) {
-        total_parallel += measure_parallel_commands(shell_path);
-        total_redirection += measure_redirection(shell_path);
-        total_builtin += measure_builtin(shell_path);
-        
-        current_test += 3;
-        print_progress(shell_name, "Basic Tests", current_test, total_tests);
+    double* samples = malloc(iterations * sizeof(double));
+    if (!samples) {
+        perror("malloc");
+        exit(1);
     }
-    printf("\n");
-    
-    results.parallel_time = total_parallel / NUM_ITERATIONS;
-    results.redirection_time = total_redirection / NUM_ITERATIONS;
-    results.builtin_time = total_builtin / NUM_ITERATIONS;
-    
-    // External command tests
-    double total_external = 0;
-    results.num_external = 0;
     
-    for (int i = 0; external_tests[i].command != NULL; i++) {
-        double total_time = 0;
-        
-        for (int j = 0; j < NUM_ITERATIONS; j++) {
-            total_time += measure_command(shell_path, external_tests[i].command);
-            current_test++;
-            print_progress(shell_name, external_tests[i].name, current_test, total_tests);
-        }
-        
-        results.external_times[i].name = external_tests[i].name;
-        results.external_times[i].time = total_time / NUM_ITERATIONS;
-        total_external += results.external_times[i].time;
-        results.num_external++;
+    for (int i = 0; i < NUM_BASIC_TESTS + num_external; i++) {
+        int expected = reference != NULL ? reference->tests[i].status : -1;
+        if (i < NUM_BASIC_TESTS) {
+            results.tests[i] = measure_test(shell_name, shell_path, basic_tests[i].name, basic_tests[i].command,
+                                            NULL, expected, samples, &current_test, total_tests);
+        } else {
+            const struct CommandTest* test = &external_tests[i - NUM_BASIC_TESTS];
+            results.tests[i] = measure_test(shell_name, shell_path, test->name, test->command,
+                                            test, expected, samples, &current_test, total_tests);
+            results.external_avg += results.tests[i].stats.mean / num_external;
+        }
+        results.num_tests++;
     }
     printf("\n");
+    free(samples);
     
-    results.external_avg = total_external / results.num_external;
-    results.overall_avg = (results.parallel_time + results.redirection_time + 
-                          results.builtin_time + results.external_avg) / 4;
+    results.overall_avg = (results.tests[0].stats.mean + results.tests[1].stats.mean +
+                           results.tests[2].stats.mean + results.external_avg) / 4;
     
     return results;
 }
 
-void write_results_to_string(const char* shell_name, struct BenchmarkResults results, char* buffer) {
-    int offset = 0;
-    
-    offset += sprintf(buffer + offset, "\nResults for %s:\n", shell_name);
-    offset += sprintf(buffer + offset, "----------------------------------------\n");
-    offset += sprintf(buffer + offset, "Basic Command Tests:\n");
-    offset += sprintf(buffer + offset, "  Parallel execution time: %.3f ms\n", results.parallel_time);
-    offset += sprintf(buffer + offset, "  Redirection time: %.3f ms\n", results.redirection_time);
-    offset += sprintf(buffer + offset, "  Built-in command time: %.3f ms\n", results.builtin_time);
+// write_results - the mean stays the first number after each test's name, that's what --compare reads back
+void write_results(FILE* out, const char* shell_name, const struct BenchmarkResults* results) {
+    fprintf(out, "\nResults for %s:\n", shell_name);
+    fprintf(out, "----------------------------------------\n");
+    fprintf(out, "Basic Command Tests:\n");
+    for (int i = 0; i < NUM_BASIC_TESTS; i++) {
+        const struct Stats* s = &results->tests[i].stats;
+        fprintf(out, "  %s: %.3f ms  (p50 %.3f, p90 %.3f, p99 %.3f, 95%% CI +/-%.3f, %d outliers)\n",
+                results->tests[i].name, s->mean, s->p50, s->p90, s->p99, s->ci95, s->outliers);
+    }
     
-    offset += sprintf(buffer + offset, "\nExternal Command Tests:\n");
-    offset += sprintf(buffer + offset, "%-25s %15s\n", "Command", "Time (ms)");
-    offset += sprintf(buffer + offset, "----------------------------------------\n");
+    fprintf(out, "\nExternal Command Tests:\n");
+    fprintf(out, "%-63s %9s %9s %9s %9s %9s %8s\n", "Command", "Mean (ms)", "p50", "p90", "p99", "95% CI", "Outliers");
+    fprintf(out, "----------------------------------------\n");
     
-    for (int i = 0; i < results.num_external; i++) {
-        offset += sprintf(buffer + offset, "%-25s %15.3f\n", 
-                results.external_times[i].name, 
-                results.external_times[i].time);
+    for (int i = NUM_BASIC_TESTS; i < results->num_tests; i++) {
+        const struct Stats* s = &results->tests[i].stats;
+        fprintf(out, "%-63s %9.3f %9.3f %9.3f %9.3f %9.3f %8d\n",
+                results->tests[i].name, s->mean, s->p50, s->p90, s->p99, s->ci95, s->outliers);
     }
     
-    offset += sprintf(buffer + offset, "\nSummary:\n");
-    offset += sprintf(buffer + offset, "  Average external command time: %.3f ms\n", results.external_avg);
-    offset += sprintf(buffer + offset, "  Overall average: %.3f ms\n\n", results.overall_avg);
+    fprintf(out, "\nSummary:\n");
+    fprintf(out, "  Average external command time: %.3f ms\n", results->external_avg);
+    fprintf(out, "  Overall average: %.3f ms\n\n", results->overall_avg);
+}
+
+// write_json_string - none of the names or commands need more than quotes and backslashes escaped
+void write_json_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+int write_json(const char* path, int num_shells, char names[][64], const struct BenchmarkResults* results) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror("Failed to open JSON output file");
+        return 1;
+    }
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"warmup\": %d,\n  \"runner_cpu\": %d,\n  \"shell_cpu\": %d,\n  \"shells\": [\n",
+            iterations, warmup, runner_cpu, shell_cpu);
+    for (int i = 0; i < num_shells; i++) {
+        fprintf(out, "    {\n      \"name\": ");
+        write_json_string(out, names[i]);
+        fprintf(out, ",\n      \"external_avg_ms\": %.3f,\n      \"overall_avg_ms\": %.3f,\n      \"tests\": [\n",
+                results[i].external_avg, results[i].overall_avg);
+        for (int j = 0; j < results[i].num_tests; j++) {
+            const struct TestResult* test = &results[i].tests[j];
+            fprintf(out, "        {\"name\": ");
+            write_json_string(out, test->name);
+            fprintf(out, ", \"command\": ");
+            write_json_string(out, test->command);
+            fprintf(out, ", \"status\": %d, \"mean_ms\": %.3f, \"ci95_ms\": %.3f, \"min_ms\": %.3f, \"p50_ms\": %.3f, "
+                    "\"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"outliers\": %d}%s\n",
+                    test->status, test->stats.mean, test->stats.ci95, test->stats.min, test->stats.p50,
+                    test->stats.p90, test->stats.p99, test->stats.max, test->stats.outliers,
+                    j + 1 < results[i].num_tests ? "," : "");
+        }
+        fprintf(out, "      ]\n    }%s\n", i + 1 < num_shells ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0 ? 0 : 1;
+}
+
+// Compare mode (--compare FILE): each test's mean against the one in a stored benchmark.txt, old format or new
+// read_file - the whole file, NUL terminated, so the baseline can be overwritten by this run's results
+char* read_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open the baseline");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* text = malloc(size + 1);
+    if (text) {
+        text[fread(text, 1, size, file)] = '\0';
+    }
+    fclose(file);
+    return text;
+}
+
+// baseline_mean - the first number after `name` at the start of a line of the shell's section, -1 if it isn't there
+double baseline_mean(const char* baseline, const char* shell_name, const char* name) {
+    char header[128];
+    snprintf(header, sizeof(header), "Results for %s:\n", shell_name);
+    const char* section = strstr(baseline, header);
+    if (!section) {
+        return -1;
+    }
+    section += strlen(header);
+    const char* next = strstr(section, "Results for ");
+    size_t length = strlen(name);
+    for (const char* line = section; line && *line && (!next || line < next); line = strchr(line, '\n')) {
+        line += *line == '\n';
+        while (*line == ' ') {
+            line++;
+        }
+        if (strncmp(line, name, length) == 0 && (line[length] == ':' || line[length] == ' ')) {
+            return strtod(line + length + (line[length] == ':'), NULL);
+        }
+    }
+    return -1;
+}
+
+// compare_results - a test regresses when even the low end of its 95% CI is more than threshold % above the baseline,
+// so noise alone doesn't fail the gate. Returns the number of regressions.
+int compare_results(const char* baseline, const char* shell_name, const struct BenchmarkResults* results, double threshold) {
+    int regressions = 0;
+    printf("\n%s against the baseline (threshold %.1f%%):\n", shell_name, threshold);
+    printf("%-63s %10s %10s %8s\n", "Test", "Base (ms)", "Now (ms)", "Change");
+    for (int i = 0; i < results->num_tests; i++) {
+        const struct TestResult* test = &results->tests[i];
+        double base = baseline_mean(baseline, shell_name, test->name);
+        if (base <= 0) {
+            printf("%-63s %10s %10.3f\n", test->name, "-", test->stats.mean);
+            continue;
+        }
+        int regressed = test->stats.mean - test->stats.ci95 > base * (1 + threshold / 100);
+        printf("%-63s %10.3f %10.3f %+7.1f%%%s\n", test->name, base, test->stats.mean,
+               (test->stats.mean - base) / base * 100, regressed ? "  REGRESSION" : "");
+        regressions += regressed;
+    }
+    return regressions;
+}
+
+// Lexer scan benchmark (./performance --scan): GB/s of each scan.h scanner over a 1MB line
+typedef const char* (*ScanFunction)(const char*, const char*);
+
+// Splits the line into words the way parse_line does, returns the word count so the work can't be optimized away
+size_t count_words(ScanFunction scan, const char* line, size_t length) {
+    const char* current = line;
+    const char* end = line + length;
+    size_t words = 0;
+    while (current < end) {
+        if (char_classes[(unsigned char) *current] == CHAR_WORD) {
+            current = scan(current, end);
+            words++;
+        } else {
+            current++;
+        }
+    }
+    return words;
+}
+
+void time_scanner(const char* name, ScanFunction scan, const char* line, size_t length) {
+    struct timespec start, end;
+    size_t words = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < SCAN_PASSES; i++) {
+        words += count_words(scan, line, length);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("  %-8s %8.2f GB/s  (%zu words per pass)\n", name, (double) length * SCAN_PASSES / seconds / 1e9, words / SCAN_PASSES);
+}
+
+int run_scan_benchmark(void) {
+    char* line = malloc(SCAN_LINE_SIZE + 1);
+    if (!line) {
+        perror("malloc");
+        return 1;
+    }
+    // Typical: a long argument list of paths, with the odd redirect and pipe. Long tokens: 4KB words.
+    const char* shapes[] = {"typical", "long tokens"};
+    for (int shape = 0; shape < 2; shape++) {
+        size_t length = 0;
+        for (int word = 0; length < SCAN_LINE_SIZE - 64; word++) {
+            if (shape == 0) {
+                length += snprintf(line + length, 64, "src/module_%d/file_%d.c %s", word % 97, word, word % 50 == 0 ? "| " : "");
+            } else {
+                size_t size = SCAN_LINE_SIZE - 1 - length < 4096 ? SCAN_LINE_SIZE - 1 - length : 4096;
+                memset(line + length, 'x', size);
+                length += size;
+                line[length++] = ' ';
+            }
+        }
+        line[length] = '\0';
+        printf("%s (%zu bytes, %d passes):\n", shapes[shape], length, SCAN_PASSES);
+        time_scanner("scalar", scan_word_scalar, line, length);
+#ifdef SCAN_X86
+        time_scanner("sse2", scan_word_sse2, line, length);
+        if (__builtin_cpu_supports("avx2")) {
+            time_scanner("avx2", scan_word_avx2, line, length);
+        }
+#endif
+        time_scanner("dispatch", scan_word, line, length);
+    }
+    free(line);
+    return 0;
 }
 
-int main() {
+// Batch throughput (./performance --batch): lines per second through a script of trivial commands
+#define BATCH_SCRIPT "batch_benchmark.sh"
+
+// time_script - runs `shell script` once with output discarded, returns the wall time in seconds
+double time_script(const char* shell) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+        execlp(shell, shell, BATCH_SCRIPT, NULL);
+        _exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int run_batch_benchmark(void) {
+    struct {
+        const char* name;
+        const char* line;
+        int lines;
+    } scripts[] = {
+        {"builtin (cd .)", "cd .\n", 200000},
+        {"external (uname)", "uname\n", 5000},
+        {"blank lines", "\n", 1000000},
+    };
+    const char* shells[] = {"/bin/bash", qish_path};
+    for (int i = 0; i < 3; i++) {
+        FILE* script = fopen(BATCH_SCRIPT, "w");
+        if (!script) {
+            perror("Failed to write the batch script");
+            return 1;
+        }
+        for (int line = 0; line < scripts[i].lines; line++) {
+            fputs(scripts[i].line, script);
+        }
+        fclose(script);
+        printf("%s, %d lines:\n", scripts[i].name, scripts[i].lines);
+        for (int j = 0; j < 2; j++) {
+            double seconds = time_script(shells[j]);
+            printf("  %-10s %12.0f lines/s\n", shells[j], scripts[i].lines / seconds);
+        }
+    }
+    unlink(BATCH_SCRIPT);
+    return 0;
+}
+
+// Usage: ./performance [options] [backend ...]
+// qish is the binary at --shell (./shell by default). With no backends it runs with its default spawn backend.
+// Otherwise qish is benchmarked once per listed backend (fork, vfork, posix_spawn, clone), selected through QISH_SPAWN.
+void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-n iterations] [-w warmup] [--shell PATH] [--cpu RUNNER[,SHELL]] [--json FILE]\n"
+            "       [--compare BASELINE [--threshold PERCENT]] [--batch | --scan] [backend ...]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    enum { MODE_SHELLS, MODE_BATCH, MODE_SCAN } mode = MODE_SHELLS;
+    const char* json_path = NULL;
+    const char* baseline_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    struct option options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"shell", required_argument, NULL, 'S'},
+        {"cpu", required_argument, NULL, 'c'},
+        {"json", required_argument, NULL, 'j'},
+        {"compare", required_argument, NULL, 'C'},
+        {"threshold", required_argument, NULL, 't'},
+        {"batch", no_argument, NULL, 'b'},
+        {"scan", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    char* end;
+    while ((option = getopt_long(argc, argv, "n:w:c:j:C:t:", options, NULL)) != -1) {
+        switch (option) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'S':
+                qish_path = optarg;
+                break;
+            case 'c':
+                // RUNNER[,SHELL]: the shell gets its own CPU so the runner's waitpid wakeups don't share a core with it
+                runner_cpu = strtol(optarg, &end, 10);
+                shell_cpu = *end == ',' ? strtol(end + 1, &end, 10) : runner_cpu;
+                if (*end != '\0' || runner_cpu < 0 || shell_cpu < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'C':
+                baseline_path = optarg;
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'b':
+                mode = MODE_BATCH;
+                break;
+            case 's':
+                mode = MODE_SCAN;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (iterations < 1 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Isolate the CPUs (isolcpus= / cpuset) for this to mean much: pinning alone still shares them with everything else.
+    // Both are checked here, a failed pin in the forked shell would only show up as odd numbers.
+    cpu_set_t allowed;
+    if (runner_cpu >= 0 && (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || runner_cpu >= CPU_SETSIZE ||
+                            shell_cpu >= CPU_SETSIZE || !CPU_ISSET(runner_cpu, &allowed) || !CPU_ISSET(shell_cpu, &allowed))) {
+        fprintf(stderr, "--cpu %d,%d: not a CPU this process may run on\n", runner_cpu, shell_cpu);
+        return 1;
+    }
+    if (runner_cpu >= 0 && pin_to_cpu(runner_cpu) != 0) {
+        perror("sched_setaffinity");
+        return 1;
+    }
+    if (mode == MODE_BATCH) {
+        return run_batch_benchmark();
+    }
+    if (mode == MODE_SCAN) {
+        return run_scan_benchmark();
+    }
+    // Read now: this run's results may be about to overwrite it
+    char* baseline = baseline_path != NULL ? read_file(baseline_path) : NULL;
+    if (baseline_path != NULL && baseline == NULL) {
+        return 1;
+    }
+    int num_backends = optind < argc ? argc - optind : 1;
+
     // Generate all results first
-    struct BenchmarkResults bash_results = run_benchmarks("Bash", "/bin/bash");
-    struct BenchmarkResults qish_results = run_benchmarks("qish", "./qish");
-    
-    // Prepare the complete output in memory
-    char* output_buffer = malloc(10000);  // Allocate plenty of space
-    char* current_pos = output_buffer;
-    
-    // Write header
-    time_t now = time(NULL);
-    current_pos += sprintf(current_pos, "Shell Performance Benchmark Results\n");
-    current_pos += sprintf(current_pos, "Date: %s", ctime(&now));
-    current_pos += sprintf(current_pos, "Number of iterations per test: %d\n\n", NUM_ITERATIONS);
-    
-    // Write results for both shells
-    write_results_to_string("Bash", bash_results, current_pos);
-    current_pos += strlen(current_pos);
-    write_results_to_string("qish", qish_results, current_pos);
+    int num_shells = num_backends + 1;
+    struct BenchmarkResults results[num_shells];
+    char names[num_shells][64];
+    snprintf(names[0], sizeof(names[0]), "Bash");
+    results[0] = run_benchmarks(names[0], "/bin/bash", NULL);
+    for (int i = 0; i < num_backends; i++) {
+        if (optind < argc) {
+            setenv("QISH_SPAWN", argv[optind + i], 1);
+            snprintf(names[i + 1], sizeof(names[i + 1]), "qish (%s)", argv[optind + i]);
+        } else {
+            snprintf(names[i + 1], sizeof(names[i + 1]), "qish");
+        }
+        results[i + 1] = run_benchmarks(names[i + 1], qish_path, &results[0]);
+    }
     
-    // Write everything to file at once
     FILE* output = fopen(OUTPUT_FILE, "w");
     if (!output) {
         perror("Failed to open output file");
-        free(output_buffer);
+        free(baseline);
         return 1;
     }
     
-    fputs(output_buffer, output);
-    fclose(output);
-    free(output_buffer);
+    // Write header
+    time_t now = time(NULL);
+    fprintf(output, "Shell Performance Benchmark Results\n");
+    fprintf(output, "Date: %s", ctime(&now));
+    fprintf(output, "Number of iterations per test: %d (after %d warmup runs)\n", iterations, warmup);
+    if (runner_cpu >= 0) {
+        fprintf(output, "Runner pinned to CPU %d, shell to CPU %d\n", runner_cpu, shell_cpu);
+    }
+    fprintf(output, "\n");
     
+    // Write results for every shell
+    for (int i = 0; i < num_shells; i++) {
+        write_results(output, names[i], &results[i]);
+    }
+    if (fclose(output) != 0) {
+        perror("Failed to write output file");
+        free(baseline);
+        return 1;
+    }
     printf("\nBenchmark complete! Results written to %s\n", OUTPUT_FILE);
-    return 0;
+    
+    if (json_path != NULL && write_json(json_path, num_shells, names, results) != 0) {
+        free(baseline);
+        return 1;
+    }
+    
+    int regressions = 0;
+    if (baseline != NULL) {
+        for (int i = 0; i < num_shells; i++) {
+            regressions += compare_results(baseline, names[i], &results[i], threshold);
+        }
+        free(baseline);
+        printf("\n%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", baseline_path);
+    }
+    return regressions > 0 ? 1 : 0;
 }
@@ -0,0 +1,147 @@
+// scan.h - byte classification and word scanning for the qish lexer (shell.c)
+// Also included by performance.c, which benchmarks the scanners against each other (./performance --scan).
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Every byte of a line is one of these. Anything not listed in char_classes is part of a word.
+enum CharClass { CHAR_WORD, CHAR_SPACE, CHAR_REDIRECT, CHAR_INPUT, CHAR_PARALLEL, CHAR_PIPE, CHAR_END, CHAR_GROUP_OPEN, CHAR_GROUP_NEXT, CHAR_GROUP_CLOSE };
+
+static const unsigned char char_classes[256] = {
+        ['\0'] = CHAR_END, ['\n'] = CHAR_END,
+        [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+        ['>'] = CHAR_REDIRECT,
+        ['<'] = CHAR_INPUT,
+        ['&'] = CHAR_PARALLEL,
+        ['|'] = CHAR_PIPE,
+};
+
+// Inside the consumer list of a broadcast pipe, "|+ (wc -l, grep x)", ( , and ) end words too
+static const unsigned char group_char_classes[256] = {
+        ['\0'] = CHAR_END, ['\n'] = CHAR_END,
+        [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+        ['>'] = CHAR_REDIRECT,
+        ['<'] = CHAR_INPUT,
+        ['&'] = CHAR_PARALLEL,
+        ['|'] = CHAR_PIPE,
+        ['('] = CHAR_GROUP_OPEN, [','] = CHAR_GROUP_NEXT, [')'] = CHAR_GROUP_CLOSE,
+};
+
+
+// All scan_word_* return the first byte in [p, end) that isn't CHAR_WORD, or end. They never read at or past end.
+
+static inline const char* scan_word_scalar(const char* p, const char* end)
+{
+        while (p < end && char_classes[(unsigned char) *p] == CHAR_WORD)
+        {
+                p++;
+        }
+        return p;
+}
+
+
+// scan_group_word - scan_word_scalar for words in a consumer list (group_char_classes). Lists are short, no SIMD.
+// Every comma separates consumers, "(wc -l,grep x)" is two of them.
+static inline const char* scan_group_word(const char* p, const char* end)
+{
+        while (p < end && group_char_classes[(unsigned char) *p] == CHAR_WORD)
+        {
+                p++;
+        }
+        return p;
+}
+
+
+#ifdef SCAN_X86
+// 16 bytes at a time: a lane is a delimiter if it is \0, one of ' ' > < & |, or in \t..\r
+static inline const char* scan_word_sse2(const char* p, const char* end)
+{
+        const __m128i nul = _mm_setzero_si128();
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i redirect = _mm_set1_epi8('>');
+        const __m128i input = _mm_set1_epi8('<');
+        const __m128i parallel = _mm_set1_epi8('&');
+        const __m128i pipe = _mm_set1_epi8('|');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i control_span = _mm_set1_epi8('\r' - '\t');
+        while (end - p >= 16)
+        {
+                __m128i bytes = _mm_loadu_si128((const __m128i*) p);
+                __m128i hits = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(bytes, nul), _mm_cmpeq_epi8(bytes, space)),
+                        _mm_or_si128(_mm_cmpeq_epi8(bytes, redirect), _mm_or_si128(_mm_cmpeq_epi8(bytes, parallel), _mm_cmpeq_epi8(bytes, pipe))));
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, input));
+                // \t..\r: (byte - '\t') <= 4 unsigned, i.e. min(byte - '\t', 4) == byte - '\t'
+                __m128i offset = _mm_sub_epi8(bytes, tab);
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_min_epu8(offset, control_span), offset));
+                int mask = _mm_movemask_epi8(hits);
+                if (mask != 0)
+                {
+                        return p + __builtin_ctz(mask);
+                }
+                p += 16;
+        }
+        return scan_word_scalar(p, end);
+}
+
+
+// Same as scan_word_sse2, 32 bytes at a time
+__attribute__((target("avx2")))
+static inline const char* scan_word_avx2(const char* p, const char* end)
+{
+        const __m256i nul = _mm256_setzero_si256();
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i redirect = _mm256_set1_epi8('>');
+        const __m256i input = _mm256_set1_epi8('<');
+        const __m256i parallel = _mm256_set1_epi8('&');
+        const __m256i pipe = _mm256_set1_epi8('|');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i control_span = _mm256_set1_epi8('\r' - '\t');
+        while (end - p >= 32)
+        {
+                __m256i bytes = _mm256_loadu_si256((const __m256i*) p);
+                __m256i hits = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, nul), _mm256_cmpeq_epi8(bytes, space)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, redirect), _mm256_or_si256(_mm256_cmpeq_epi8(bytes, parallel), _mm256_cmpeq_epi8(bytes, pipe))));
+                hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, input));
+                __m256i offset = _mm256_sub_epi8(bytes, tab);
+                hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(_mm256_min_epu8(offset, control_span), offset));
+                unsigned int mask = (unsigned int) _mm256_movemask_epi8(hits);
+                if (mask != 0)
+                {
+                        return p + __builtin_ctz(mask);
+                }
+                p += 32;
+        }
+        return scan_word_sse2(p, end);
+}
+#endif
+
+
+// scan_word - fastest scanner the CPU supports (checked once)
+static inline const char* scan_word(const char* p, const char* end)
+{
+#ifdef SCAN_X86
+        static int has_avx2 = -1;
+        if (has_avx2 == -1)
+        {
+                __builtin_cpu_init();
+                has_avx2 = __builtin_cpu_supports("avx2");
+        }
+        // AVX2 wants 32 bytes left; anything shorter goes straight to SSE2
+        if (has_avx2 && end - p >= 32)
+        {
+                return scan_word_avx2(p, end);
+        }
+        return scan_word_sse2(p, end);
+#else
+        return scan_word_scalar(p, end);
+#endif
+}
+
+#endif
@@ -1,3 +1,14 @@
+#ifdef __linux__
+#define _GNU_SOURCE                                             // tee(2) / splice(2)
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,60 +16,512 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/stat.h> 
+#include <sys/mman.h>
 #include <sys/wait.h>
-#include <ctype.h>
+#include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include "scan.h"
 
-// Formatting
-void split_input_redir_operator(char* parsed_input, char** args);
-void null_terminate_input(char* parsed_input, char* raw_input);
-void collapse_white_space_group(char *dest, char *input);
-void parse_operator_in_args(char ***args, const char symbol);
+// Running a line
+struct CommandLine;
+void execute_line(char* input, size_t length);
+void launch_line(struct CommandLine* line);
+void wait_line(struct CommandLine* line);
+int decode_status(int status);
+void free_shell_memory();
 
-// Input redirection
-void configure_redirection(char **args);
+// Job scheduler
+struct Job;
+struct Pipeline;
+int start_job(struct Pipeline* pipeline, int background);
+void add_job_process(struct Job* job, pid_t pid, int role);
+void finish_job(int index);
+void release_job(int index);
+void start_reaper();
+void stop_reaper();
+void reap_children(int block);
+void credit_process(pid_t pid, int status, struct rusage* usage);
+void credit_job(int index, struct rusage* usage, int role, int exit_status);
+void wait_for_job_slot();
 
-// Parallel Command
-int configure_parallel(char ***arg_list, char **args);
+int wait_for_job(int index);
+int find_job(const char* spec);
+void print_job(int index, int out);
+void report_finished_jobs();
+void free_jobs();
+int parse_job_limit(const char* text);
+int handle_maxjobs(char **args, int out);
+int handle_jobs(char **args, int out);
+int handle_wait(char **args, int out);
+int handle_fg(char **args, int out);
 
-// Built-in-command handlers
-void handle_cd(char **args);
-void handle_path(char **args);
-void handle_exit(char **args, char* input);
+// Job control
+void start_job_control();
+void give_terminal(int index);
+void pass_terminal();
+void interrupt_line();
+void check_interrupts(int discard);
+void note_interrupt(int signal);
+void resume_stopped(pid_t pid, int signal);
+void reset_child_signals();
+
+// Output collation
+int select_collate_mode(const char* name);
+void start_collation(int group_count);
+int open_output_buffer();
+void collate_output(int group, int fd);
+void print_output(int group);
+
+// Batch scripts
+struct Script;
+int open_script(struct Script* script, const char* path);
+int fill_script_buffer(struct Script* script);
+char* next_script_line(struct Script* script, size_t* length);
+void close_script(struct Script* script);
+void run_script(struct Script* script);
+
+// Parsing
+void parse_line(char* input, size_t length, struct CommandLine* line);
+void link_command_line(struct CommandLine* line);
+
+// Per line memory
+struct Arena;
+void* arena_alloc(struct Arena* arena, size_t size);
+void* arena_grow(struct Arena* arena, void* old, size_t old_size, size_t new_size);
+void arena_reset(struct Arena* arena);
+void arena_free(struct Arena* arena);
+void grow_array(void** array, int* capacity, int count, size_t element_size);
+
+// Built-in-command handlers (see BUILTINS): each writes its output to out and returns its exit status
+struct Builtin;
+struct Stage;
+const struct Builtin* find_builtin(const char* name);
+int run_builtin(const struct Builtin* builtin, struct Stage* stage, int out);
+int write_all(int fd, const char* data, size_t length);
+int handle_cd(char **args, int out);
+int handle_path(char **args, int out);
+int handle_exit(char **args, int out);
+int handle_echo(char **args, int out);
+int handle_pwd(char **args, int out);
+int handle_true(char **args, int out);
+int handle_false(char **args, int out);
+int handle_test(char **args, int out);
+int evaluate_test(char **args, int count);
+int handle_printf(char **args, int out);
 void add_path(char** search_paths, int index, const char* path);
 void free_search_paths();
 
 // Initial add path Helper 
 void add_bin_path_automatically();
 
-// Finding the correct PATH dir
-void select_search_path(char *path, char* name);
+// Finding the correct PATH dir (command hash)
+struct HashEntry;
+struct HashEntry* lookup_command(const char* name);
+void exec_command(struct HashEntry* entry, char** args);
+void clear_command_hash();
+void check_search_paths();
+void reopen_relative_search_paths();
+int handle_hash(char **args, int out);
 
-// Freeing helper
-void free_args_elements(char** nested);
+// Spawn layer
+struct SpawnRequest;
+void add_spawn_action(struct SpawnRequest* request, int type, int fd, int target, const char* path);
+pid_t spawn_command(struct SpawnRequest* request);
+int select_spawn_backend(const char* name);
 
 // Executing piped commands
-void execute_piped_command(char **args);
+struct Command;
+struct Pipeline;
+void execute_piped_command(struct Pipeline *pipeline, struct Job *job, int output);
+struct PipelineFds;
+int open_pipeline_pipe(struct PipelineFds* held, int ends[2]);
+void release_pipeline_fd(struct PipelineFds* held, int fd);
+void close_pipeline_fds(struct PipelineFds* held);
+void add_pipeline_close_actions(struct SpawnRequest *request, struct PipelineFds* held);
+int fd_headroom(int wanted);
+long count_open_fds();
+void broadcast_output(int source, int* consumers, int consumer_count);
+void copy_stage_output(int source, int* files, int file_count, int next);
+void copy_stage_output_buffered(int source, int* files, int file_count, int next);
+
+// Copy fast path
+int is_copy_command(struct Stage* stage);
+int run_copy_command(struct Stage* stage);
+int copy_file(int source, int destination, struct stat* source_info, int may_clone);
+int copy_to_other_targets(struct Stage* stage);
+
+// Threaded filters
+struct Filter;
+struct Filter* parse_filter(char** argv);
+long parse_count(const char* text);
+int parse_head(struct Filter* filter, char** argv);
+int parse_wc(struct Filter* filter, char** argv);
+int parse_grep(struct Filter* filter, char** argv);
+int parse_tr_set(const char* text, unsigned char* set);
+int parse_tr(struct Filter* filter, char** argv);
+int parse_cut_list(struct Filter* filter, const char* list);
+int parse_cut(struct Filter* filter, char** argv);
+int start_filter(struct Filter* filter, int job, int role, int in, int out);
+void* run_filter(void* argument);
+int filter_read(struct Filter* filter);
+int filter_next_line(struct Filter* filter, char** line, size_t* length);
+void filter_write(struct Filter* filter, const char* data, size_t length);
+void filter_flush(struct Filter* filter);
+void filter_head(struct Filter* filter);
+void filter_wc(struct Filter* filter);
+void filter_grep(struct Filter* filter);
+void filter_tr(struct Filter* filter);
+int cut_selected(struct Filter* filter, long n);
+void filter_cut(struct Filter* filter);
+void time_filter(struct Filter* filter, int group, int stage, char** argv);
+int collect_filters();
+void close_filter_fds();
+void free_filter(struct Filter* filter);
+
+// Tracing
+struct TraceEvent;
+int start_tracing(const char* path);
+double trace_now();
+struct TraceEvent* add_trace_event(char phase, const char* name, const char* category, pid_t pid, pid_t tid);
+void trace_span(const char* name, const char* category, double start);
+void trace_spawn(pid_t pid, const char* name, double start);
+void trace_reap(pid_t pid, int status);
+void trace_thread(const char* name, pid_t tid, double start, double end);
+void write_trace_string(const char* text);
+void write_trace();
+
+// Metrics
+int start_metrics(const char* path, const char* interval);
+double metrics_now();
+void count_metric(int counter, unsigned long amount);
+void observe_metric(int histogram, double value);
+void finish_line_metrics(double start);
+void write_metrics_if_due();
+void write_metric_counter(FILE* file, const char* family, const char* labels, const char* help, unsigned long value);
+int write_metrics();
+void stop_metrics();
+
+// Timing a line (time)
+struct TimedProcess;
+void start_timing(int group_count);
+void time_group(int group);
+char* time_label(char** argv, const char* suffix);
+int time_process(pid_t pid, int group, int stage, const char* label);
+int time_in_shell(int group, struct Stage* stage, const char* kind);
+void time_in_shell_done(int row);
+void time_finished(int row, struct rusage* usage);
+void time_reaped(pid_t pid, struct rusage* usage);
+void add_usage(struct rusage* total, struct rusage* usage);
+void print_time_row(const char* group, const char* stage, const char* label, double real, struct rusage* usage);
+void report_timing();
+
+// Benchmarking a line (bench)
+int parse_bench_prefix(struct CommandLine* line, struct Stage* first);
+char* bench_text(struct CommandLine* line);
+void run_bench(struct CommandLine* line);
+int compare_samples(const void* a, const void* b);
+double percentile(double* sorted, long count, int p);
+double square_root(double value);
+void format_duration(double seconds, char* text, size_t size);
 
-#define MAXLINE 100
-#define MAXARGS 200
 #define MAXPATHS 100
-#define CONCAT_PATH_MAX 100
-#define MAX_PARALLEL_COMMANDS 100
-#define MAX_REDIRECTED_OUTPUT 4096
+#define COMMAND_HASH_BUCKETS 64
+#ifdef O_PATH
+#define DIRECTORY_FD_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define DIRECTORY_FD_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+#define MAX_REDIRECTED_OUTPUT 65536
+#define MAX_BENCH_RUNS 1000000                                  // bench -n / -w, keeps the samples at 32MB at most
+#define SPLICE_CHUNK (1 << 20)
+#define SCRIPT_READ_SIZE (256 * 1024)
+#define CLONE_STACK_SIZE (64 * 1024)
+#define FD_CHECK_THRESHOLD 64
 #define ERROR_MESSAGE "An error has occurred\n"
+#define OUTPUT_PENDING -1
+#define OUTPUT_NONE -2
+#define METRIC_BUCKETS 17
 
 char* search_paths[MAXPATHS * sizeof(char*)];
-int number_of_args = 0;
+int search_path_fds[MAXPATHS];                                  // Directory fd per search path, opened once by `path`
+time_t search_path_mtimes[MAXPATHS];                            // Each directory's mtime as the cache last saw it, 0: not seen
+int last_status = 0;                                            // Exit status of the last command line (for -c)
+int max_jobs = 2;                                               // & groups allowed to run at once, -j / maxjobs (main sets the CPU count)
+
+// Parsed command line (see PARSING)
+struct Stage {
+        char** argv;                    // NULL terminated, words point into the input line
+        int argc;
+        char** output_files;            // > targets, in order (all of them get the output)
+        int output_count;
+        int output_capacity;
+        char* input_file;               // < source, NULL if none
+        int error;                      // malformed (e.g. "ls >", "> file", "ls > a b", "ls < a < b"), reported when run
+        int first_arg;                  // index of argv[0] in CommandLine.args
+};
+
+struct Pipeline {
+        struct Stage* stages;           // stage_count stages, connected by |
+        int stage_count;
+        int first_stage;                // index of stages[0] in CommandLine.stages
+        int consumer_count;             // |+ (c1, c2): the last stages all read the output of the one before them, 0 if none
+};
+
+struct CommandLine {
+        struct Pipeline* pipelines;     // one per & group
+        int pipeline_count;
+        int pipeline_capacity;
+        struct Stage* stages;
+        int stage_count;
+        int stage_capacity;
+        char** args;
+        int arg_count;
+        int arg_capacity;
+        int background;                 // ends in & (a background job in interactive mode)
+        int timed;                      // starts with time, which isn't part of the first stage (see TIME)
+        long bench_runs;                // starts with bench: runs to measure, 0 if it doesn't (see BENCH)
+        long bench_warmup;              // and untimed runs before them
+};
+
+enum RedirectState { REDIRECT_NONE, REDIRECT_WANTS_FILE, REDIRECT_WANTS_INPUT, REDIRECT_DONE };
+enum GroupState { GROUP_NONE, GROUP_WANTS_OPEN, GROUP_OPEN, GROUP_CLOSED };
+
+// Per line memory (see ARENA)
+struct Arena {
+        struct ArenaBlock* first;
+        struct ArenaBlock* current;     // block allocations are currently bumped from
+};
+
+// Two lines in flight in batch mode: the one running and the next one, parsed ahead (see BATCH SCRIPTS)
+struct CommandLine command_lines[2];                            // Parse tables of each line, in its arena
+struct Arena line_arenas[2];                                    // Each owns all memory of its line
+struct Arena* line_arena = &line_arenas[0];                     // Arena the line being parsed or launched allocates from
+
+// One per running & group (see JOB SCHEDULER)
+enum JobState { JOB_FREE, JOB_RUNNING, JOB_DONE };
+struct Job {
+        int state;
+        int background;                 // not waited for by its line, stays JOB_DONE until reported
+        pid_t* pids;                    // every process of the job (kept across reuse of the slot)
+        int pid_count;
+        int pid_capacity;
+        unsigned char* roles;           // PROCESS_* bits of each of pids
+        int remaining;                  // processes (and filter threads) not reaped yet
+        int processes_left;             // of those, processes: while there are any, pgid can be signalled
+        int sinks_left;                 // processes writing the job's final output not reaped yet (see JOB CONTROL)
+        pid_t pgid;                     // process group of all its processes, 0 until the first one starts
+        int status;
+        struct rusage usage;            // user/system time summed over its processes, largest max RSS
+        unsigned long line;             // lines_launched when it was started
+        unsigned long started;          // start order, fg picks the latest
+        char* command;                  // text for jobs / fg (background jobs only)
+        int output_fd;                  // collation buffer its output goes to, -1 if none (see OUTPUT COLLATION)
+        int output_group;               // its & group, which owns that output
+};
+
+struct Job* jobs = NULL;                                        // Slots, reused once a job has been reaped and reported
+int job_slots = 0;
+unsigned long jobs_started = 0;
+unsigned long lines_launched = 0;                               // Serial of the line being launched or waited for
+int line_last_job = -1;                                         // Its job whose exit status becomes the line's, -1 if none
+int line_running_jobs = 0;                                      // Its jobs still running (what max_jobs limits)
+int interactive = 0;                                            // Trailing & only backgrounds a line at the prompt
+int in_builtin_stage = 0;                                       // Set in a forked child running a builtin pipeline stage
+int child_signal_fd = -1;                                       // signalfd for SIGCHLD (Linux)
+int reaper_epoll_fd = -1;
+sigset_t original_signal_mask;                                  // Restored in children before exec
+
+// Process groups, the terminal and Ctrl-C (see JOB CONTROL)
+enum ProcessRole { PROCESS_HELPER = 0, PROCESS_LAST_STAGE = 1, PROCESS_SINK = 2 };
+int terminal_fd = -1;                                           // Controlling terminal, if the shell started in its foreground
+int terminal_job = -1;                                          // Foreground job that has it, -1: the shell
+int watch_interrupts = 0;                                       // SIGINT wasn't ignored when the shell started
+volatile sig_atomic_t interrupt_pending = 0;                    // SIGINT seen by note_interrupt (no signalfd)
+int line_interrupted = 0;                                       // The line being run got a SIGINT: nothing more of it starts
+
+// Batch script, mapped or read in large blocks (see BATCH SCRIPTS)
+struct Script {
+        char* data;                     // mapped file, or read buffer
+        size_t length;                  // bytes of script in data
+        size_t position;                // start of the next line
+        size_t capacity;                // read buffer size, 0 when mapped
+        int fd;
+        int at_eof;                     // read buffer: nothing left to read
+        char* last_line;                // copy of a mapped script's unterminated last line, it needs a \0 after it
+};
+struct Script script = {.fd = -1};
+char* input_buffer = NULL;                                      // getline / -c line
+
+// Output of & groups buffered and printed whole (see OUTPUT COLLATION)
+enum CollateMode { COLLATE_OFF, COLLATE_ORDER, COLLATE_FINISH };
+const char* collate_mode_names[] = {"off", "order", "finish", NULL};
+int collate_mode = COLLATE_OFF;                                 // -o / QISH_COLLATE
+int* line_outputs = NULL;                                       // Per & group of the line: its buffer fd, OUTPUT_PENDING, or OUTPUT_NONE
+int line_output_count = 0;
+int line_outputs_printed = 0;                                   // order: groups before this one have been printed
+
+// Pipeline stages run as threads in the shell (see THREADED FILTERS)
+int thread_filters = 0;                                         // -t / QISH_THREADS
+struct Filter* running_filters = NULL;                          // Started and not collected yet
+int filter_done_pipe[2] = {-1, -1};                             // Each finished filter writes its Filter* here
+int null_fd = -1;                                               // /dev/null, dup'd over a finished filter's fds
+
+// Trace-event timeline, QISH_TRACE=file.json (see TRACING)
+FILE* trace_file = NULL;                                        // NULL: not tracing
+struct TraceEvent* trace_events = NULL;                         // Everything recorded so far, written out at exit
+int trace_event_count = 0;
+int trace_event_capacity = 0;
+struct TraceProcess* trace_processes = NULL;                    // Children spawned and not reaped yet
+int trace_process_count = 0;
+int trace_process_capacity = 0;
+struct timespec trace_epoch;
+pid_t trace_pid = 0;                                            // The shell's lane
+
+// Counters and histograms, QISH_METRICS=file.prom (see METRICS)
+enum MetricCounter { METRIC_FORKS_COMMAND, METRIC_FORKS_BUILTIN, METRIC_FORKS_HELPER, METRIC_NOT_FOUND, METRIC_EXEC_FAILED,
+        METRIC_PATH_PROBES, METRIC_TEE_BYTES, METRIC_BROADCAST_BYTES, METRIC_COUNTER_COUNT };
+enum MetricHistogramType { METRIC_LINE_SECONDS, METRIC_SPAWN_SECONDS, METRIC_PIPELINE_DEPTH, METRIC_PARALLEL_WIDTH, METRIC_HISTOGRAM_COUNT };
+struct Metrics* metrics = NULL;                                 // NULL: not counting. A shared mapping, forked helpers count too
+char* metrics_path = NULL;
+char* metrics_temporary_path = NULL;                            // Written first, then renamed to metrics_path
+int metrics_interval = 0;                                       // QISH_METRICS_INTERVAL: seconds between dumps, 0: only at exit
+double metrics_due = 0;                                         // metrics_now() of the next dump
+int metrics_timer_fd = -1;                                      // timerfd that wakes the reaper when a dump is due (Linux)
+double line_started = 0;                                        // metrics_now() when the line being run was launched
+
+// Where the time of a line that starts with `time` went (see TIME)
+int timing = 0;                                                 // The line being run is timed
+double timing_started = 0;
+struct TimedProcess* timed_processes = NULL;                    // A row per process, thread or builtin, in the line's arena
+int timed_count = 0;
+int timed_capacity = 0;
+double* timed_group_starts = NULL;                              // Per & group, when it was launched
+int timed_group_count = 0;
+
+// A line run over and over by bench, in an arena of its own (see BENCH)
+struct CommandLine bench_line;
+struct Arena bench_arena;
+int benchmarking = 0;                                           // Runs can't start another bench
+
+// Spawn backends (see SPAWN LAYER)
+enum SpawnBackend { SPAWN_BACKEND_FORK, SPAWN_BACKEND_VFORK, SPAWN_BACKEND_POSIX_SPAWN, SPAWN_BACKEND_CLONE };
+const char* spawn_backend_names[] = {"fork", "vfork", "posix_spawn", "clone", NULL};
+enum SpawnBackend spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+
+// What the child does to its fds before exec, in order
+enum SpawnActionType { SPAWN_DUP2, SPAWN_OPEN, SPAWN_OPEN_INPUT, SPAWN_CLOSE };
+struct SpawnAction {
+        int type;
+        int fd;                         // SPAWN_DUP2 / SPAWN_CLOSE: fd to dup / close
+        int target;                     // SPAWN_DUP2 / SPAWN_OPEN*: fd it should end up as
+        const char* path;               // SPAWN_OPEN: file to truncate and write to, SPAWN_OPEN_INPUT: file to read
+};
+
+struct SpawnRequest {
+        struct HashEntry* command;      // resolved executable
+        const struct Builtin* builtin;  // or a builtin, run in a forked child instead of exec'ing anything
+        char** args;                    // NULL terminated argv
+        pid_t process_group;            // its job's group to join, 0: a new one it leads
+        struct SpawnAction* actions;
+        int action_count;
+        int action_capacity;
+};
+
 
 int main(int argc, char *argv[])
 {
-        char* input = malloc(MAXLINE);
-        if (input == NULL)
+        size_t input_capacity = 0;                                      // getline grows input_buffer to fit the longest line
+
+        // Spawn backend: QISH_SPAWN=<backend>, overridden by -s <backend>
+        if (getenv("QISH_SPAWN") != NULL && select_spawn_backend(getenv("QISH_SPAWN")) == -1)
         {
                 write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
                 exit(1);
         }
-        int batch_mode = 0;
+        if (getenv("QISH_TRACE") != NULL && start_tracing(getenv("QISH_TRACE")) == -1)       // Timeline of the session (see TRACING)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                exit(1);
+        }
+        if (getenv("QISH_METRICS") != NULL && start_metrics(getenv("QISH_METRICS"), getenv("QISH_METRICS_INTERVAL")) == -1)        // (see METRICS)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                exit(1);
+        }
+        thread_filters = getenv("QISH_THREADS") != NULL;               // Filter stages as threads: QISH_THREADS, or -t
+        if (getenv("QISH_COLLATE") != NULL && select_collate_mode(getenv("QISH_COLLATE")) == -1)      // Same for -o <mode>
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                exit(1);
+        }
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_jobs = online_cpus > 2 ? online_cpus : 2;                   // Even on one CPU, a & b still run side by side
+        int option;
+        opterr = 0;
+        char* command_string = NULL;
+        while ((option = getopt(argc, argv, "s:c:j:to:")) != -1)
+        {
+                if (option == 't')
+                {
+                        thread_filters = 1;
+                        continue;
+                }
+                if (option == 'c')
+                {
+                        command_string = optarg;
+                        continue;
+                }
+                if (option == 'o' && select_collate_mode(optarg) == 0)
+                {
+                        continue;
+                }
+                if (option == 'j' && (max_jobs = parse_job_limit(optarg)) > 0)
+                {
+                        continue;
+                }
+                if (option != 's' || select_spawn_backend(optarg) == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        exit(1);
+                }
+        }
+        argc -= optind - 1;
+        argv += optind - 1;
+        start_reaper();
+        start_job_control();
+        signal(SIGPIPE, SIG_IGN);                                       // A builtin writing to a closed pipe gets EPIPE instead of killing the shell
+
+        // -c "command string": run one line through the normal path, exit with its status
+        if (command_string != NULL)
+        {
+                if (argc > 1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        exit(1);
+                }
+                // Same shape as a line from getline: \n and then \0 terminated
+                size_t length = strlen(command_string) + 1;
+                input_buffer = malloc(length + 1);
+                if (input_buffer == NULL)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        exit(1);
+                }
+                strcpy(input_buffer, command_string);
+                strcat(input_buffer, "\n");
+
+                add_bin_path_automatically();
+                execute_line(input_buffer, length);
+                free_shell_memory();
+                exit(last_status);
+        }
 
         // Handle Batch mode
         if (argc > 1)
@@ -68,715 +531,5134 @@ int main(int argc, char *argv[])
                         write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
                         exit(1);
                 }
-                batch_mode = 1;
-
-                int fd;
-                if ((fd = open(argv[1], O_RDONLY)) == -1)
+                if (open_script(&script, argv[1]) == -1)
                 {
                         write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
                         exit(1);
                 }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
+                add_bin_path_automatically();
+                run_script(&script);
+                free_shell_memory();
+                exit(0);
         }
         
         add_bin_path_automatically();
+        interactive = 1;
 
         while (1)                                                       // Main While loop
         {
-                if (!batch_mode)                                        // Interactive mode prompt
-                {
-                        printf("process> ");
-                        fflush(stdout);
-                }
-                size_t variable = (long) MAXLINE;
-                ssize_t read = getline(&input, &variable, stdin);
+                report_finished_jobs();                                 // Background jobs that ended since the last prompt
+                printf("process> ");                                    // Interactive mode prompt
+                fflush(stdout);
+                double reading = trace_now();
+                ssize_t read = getline(&input_buffer, &input_capacity, stdin);
+                trace_span("read line", "input", reading);
 
                 if (read == -1)
                 {
                         break;
                 }
                 
-                // Handle empty input line
-                // Case: Works for both batch mode since we simply skip \n as normal behaviour. If EOF is after \n, we will catch it in the next getline.
-                // Case: If \n happens, args was never allocated since we continue, and we don't free args outside of this loop. so no double free or leak.
-                // Outside of the while: input and paths, which are freed outside the while loop at the end.
-                if (input[0] == '\n')   
+                execute_line(input_buffer, read);
+        }
+        free_shell_memory();
+}
+
+
+// execute_line - parses and runs one input line of length bytes, and waits for everything it started.
+// input[length] must be a writable \0 (getline leaves one). The exit status of the line's last command (like sh) is left in last_status.
+void execute_line(char* input, size_t length)
+{
+        line_arena = &line_arenas[0];
+        parse_line(input, length, &command_lines[0]);
+        launch_line(&command_lines[0]);
+        wait_line(&command_lines[0]);
+        arena_reset(line_arena);                                        // Everything the line allocated goes at once
+}
+
+
+// launch_line - runs the builtins and starts the processes of a parsed line, without waiting for them.
+// Spawn actions are allocated from line_arena, which must be the line's arena.
+// The job whose exit status becomes the line's status (like sh: the last command's) is left in line_last_job,
+// if it is -1 last_status already holds the status.
+void launch_line(struct CommandLine* line)
+{
+        if (line->bench_runs > 0)                                       // The runs are lines of their own (see BENCH)
+        {
+                run_bench(line);
+                return;
+        }
+        double launching = trace_now();
+        line_started = metrics != NULL ? metrics_now() : 0;
+        lines_launched++;
+        line_interrupted = 0;
+        check_interrupts(interactive);                                  // At the prompt, Ctrl-C only dropped what was being typed
+        line_running_jobs = 0;
+        line_last_job = -1;
+        last_status = 0;
+        int background = line->background && interactive;
+        start_collation(collate_mode != COLLATE_OFF && line->pipeline_count > 1 && !background ? line->pipeline_count : 0);
+        if (line->pipeline_count > 0)
+        {
+                observe_metric(METRIC_PARALLEL_WIDTH, line->pipeline_count);
+        }
+        if (line->timed && !background)
+        {
+                start_timing(line->pipeline_count);
+        }
+
+        for (int i = 0; i < line->pipeline_count && !line_interrupted; i++)
+        {
+                line_last_job = -1;                                     // Set before waiting for a slot, so an earlier group's status can't stick
+                last_status = 0;
+
+                struct Pipeline *pipeline = &line->pipelines[i];
+                time_group(i);
+                int malformed = 0;
+                for (int j = 0; j < pipeline->stage_count; j++)
+                {
+                        malformed |= pipeline->stages[j].error;
+                }
+                if (malformed)
                 {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        last_status = 1;
+                        collate_output(i, -1);
                         continue;
                 }
-                
-                char parsed_input[MAXLINE];
-                null_terminate_input(parsed_input, input);
-                collapse_white_space_group(parsed_input, parsed_input);
+                observe_metric(METRIC_PIPELINE_DEPTH, pipeline->stage_count);
+                int output = line_outputs != NULL ? open_output_buffer() : -1;         // Collated: the group's stdout is buffered
+
+                // cat f1 f2 > out and cat < in > out are copied by the kernel, without a fork either (see COPY FAST PATH).
+                // Only for a line of one group: the copy runs in the shell, and would hold up the groups after it.
+                struct Stage *stage = &pipeline->stages[0];
+                int copy = pipeline->stage_count == 1 && line->pipeline_count == 1 && is_copy_command(stage);
+
+                // has a pipe in the external command (or several > targets, which need a fan out helper)
+                if (pipeline->stage_count > 1 || (stage->output_count > 1 && find_builtin(stage->argv[0]) == NULL && !copy))
+                {
+                        int job = start_job(pipeline, background);
+                        jobs[job].output_fd = output;
+                        jobs[job].output_group = i;
+                        if (line_interrupted)                           // Ctrl-C while it waited for a slot
+                        {
+                                finish_job(job);
+                                release_job(job);
+                                break;
+                        }
+                        execute_piped_command(pipeline, &jobs[job], output != -1 ? output : STDOUT_FILENO);
+                        line_last_job = job;
+                        if (jobs[job].remaining == 0)                   // Case: no stage could be started
+                        {
+                                finish_job(job);
+                        }
+                        continue;
+                }
+
+                char **single_command = stage->argv;
 
-                // Generate arguments across the line
-                // SIZE: 20 * sizeof(char*) = 20 * 8 = 160 (20 strings vs 20 bytes)
-                char **args = malloc(MAXARGS * sizeof(char*));  
-                if (args == NULL)
+                if (copy)
+                {
+                        double copying = trace_now();
+                        int timed = time_in_shell(i, stage, " (kernel copy)");
+                        last_status = run_copy_command(stage);
+                        time_in_shell_done(timed);
+                        trace_span("copy", "builtin", copying);
+                        collate_output(i, output);
+                        continue;
+                }
+
+                // Builtins run right here, without a fork
+                const struct Builtin* builtin = find_builtin(single_command[0]);
+                if (builtin != NULL)
+                {
+                        double running = trace_now();
+                        int timed = time_in_shell(i, stage, " (builtin)");
+                        last_status = run_builtin(builtin, stage, output != -1 ? output : STDOUT_FILENO);
+                        time_in_shell_done(timed);
+                        trace_span(single_command[0], "builtin", running);
+                        collate_output(i, output);
+                        continue;
+                }
+
+                // default execution code
+                struct SpawnRequest request = {0};
+                double looking_up = trace_now();
+                request.command = lookup_command(single_command[0]);          // resolved in the shell so the result is cached
+                trace_span("lookup", "lookup", looking_up);
+                request.args = single_command;
+                if (request.command == NULL)
                 {
                         write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        count_metric(METRIC_NOT_FOUND, 1);
+                        last_status = 1;
+                        collate_output(i, output);
                         continue;
                 }
-                split_input_redir_operator(parsed_input, args);
-                parse_operator_in_args(&args, '&');
-                parse_operator_in_args(&args, '|');
-                
-                // Check for parallel commands
-                char** command_arg_list[MAX_PARALLEL_COMMANDS] = {0};
-                int parallel_commands = configure_parallel(command_arg_list, args);
-                
-                for (int i = 0; command_arg_list[i] != NULL; i++)
+                if (output != -1)
+                {
+                        add_spawn_action(&request, SPAWN_DUP2, output, STDOUT_FILENO, NULL);
+                }
+                if (stage->output_count > 0)
+                {
+                        add_spawn_action(&request, SPAWN_OPEN, -1, STDOUT_FILENO, stage->output_files[0]);
+                }
+                if (stage->input_file != NULL)
+                {
+                        add_spawn_action(&request, SPAWN_OPEN_INPUT, -1, STDIN_FILENO, stage->input_file);
+                }
+                int job = start_job(pipeline, background);
+                jobs[job].output_fd = output;
+                jobs[job].output_group = i;
+                if (line_interrupted)
                 {
-                        // Single command refers to each NULL termination separated location in args.
-                        // Therefore, I don't need to free args again
-                        char **single_command = command_arg_list[i];
+                        finish_job(job);
+                        release_job(job);
+                        break;
+                }
+                request.process_group = jobs[job].pgid;
+                pid_t pid = spawn_command(&request);
+                if (pid < 0)
+                {
+                        finish_job(job);
+                        release_job(job);
+                        last_status = 1;
+                        continue;
+                }
+                add_job_process(&jobs[job], pid, PROCESS_LAST_STAGE | PROCESS_SINK);
+                time_process(pid, i, 0, time_label(single_command, ""));
+                line_last_job = job;
+        }
+        if (background)                                                 // The prompt comes back right away, with status 0
+        {
+                line_last_job = -1;
+                last_status = 0;
+        }
+        trace_span("launch", "run", launching);
+}
 
-                        // Check if built in command (exit, cd, path)
-                        if (strcmp("exit", single_command[0]) == 0)
-                        {
-                                handle_exit(single_command, input);
-                                continue;
-                        }
-                        if (strcmp("cd", single_command[0]) == 0)
+
+// wait_line - reaps every job the launched line started, the last job's status becomes last_status.
+// Lines that only ran builtins (or nothing) don't wait at all, and neither do background lines.
+void wait_line(struct CommandLine* line)
+{
+        if (line->bench_runs > 0)                                       // run_bench waited for every run
+        {
+                return;
+        }
+        if (line->background && interactive)
+        {
+                finish_line_metrics(line_started);
+                return;
+        }
+        double waiting = trace_now();
+        while (line_running_jobs > 0)
+        {
+                reap_children(1);
+        }
+        trace_span("wait", "run", waiting);
+        report_timing();
+        finish_line_metrics(line_started);
+        if (line_interrupted)
+        {
+                last_status = 128 + SIGINT;
+                if (!interactive)                                       // Ctrl-C stops a script (or -c) altogether, like sh
+                {
+                        free_shell_memory();
+                        exit(last_status);
+                }
+                write(STDOUT_FILENO, "\n", 1);                         // The prompt goes after the ^C
+        }
+}
+
+
+////// JOB SCHEDULER
+
+// Every & group is a job: a plain command, or every stage and tee helper of a pipeline. Nothing is waited on
+// while a line is launched, so "a | b & c | d & e | f" runs all three pipelines at once and the line takes as
+// long as the slowest one. At most max_jobs jobs of a line run at once (default: one per online CPU, at least 2):
+// a group that would go over the limit waits in launch_line until any running job exits, so a line with 100
+// compressors runs them max_jobs at a time instead of all at once.
+// Jobs live in a malloc'd table of slots (it only grows to the most jobs that ever ran at once, and owns nothing
+// in line_arena); a slot is reused once every process of its job has been reaped (and reported, for background jobs).
+//
+// One reaper collects every child. On Linux SIGCHLD is blocked and read from a signalfd, which an epoll set
+// sleeps on; each wakeup drains all exited children with wait4(WNOHANG), which also returns their rusage.
+// Elsewhere the reaper is a blocking wait4. Each exited process is credited to its job, which adds up the
+// processes' resource usage and takes the exit status of its last stage.
+// At the prompt, a line ending in & runs in the background: the prompt comes straight back, the job is listed
+// by `jobs`, can be waited for with `wait` / `fg`, and is reported as Done before a later prompt.
+// Batch scripts and -c still wait for such lines, like they always have.
+
+// start_job - waits for a free slot (see max_jobs) and claims it, returns its index in jobs
+int start_job(struct Pipeline* pipeline, int background)
+{
+        wait_for_job_slot();
+
+        int index = 0;
+        while (index < job_slots && jobs[index].state != JOB_FREE)
+        {
+                index++;
+        }
+        if (index == job_slots)
+        {
+                struct Job* grown = realloc(jobs, (job_slots + 1) * sizeof(struct Job));
+                if (grown == NULL)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        exit(1);
+                }
+                jobs = grown;
+                jobs[job_slots++] = (struct Job){0};
+        }
+        struct Job* job = &jobs[index];
+        job->state = JOB_RUNNING;
+        job->background = background;
+        job->pid_count = 0;
+        job->remaining = 0;
+        job->processes_left = 0;
+        job->sinks_left = 0;
+        job->pgid = 0;
+        job->status = 1;                                                // Stays 1 if the last stage can't be started
+        job->usage = (struct rusage){0};
+        job->line = lines_launched;
+        job->started = ++jobs_started;
+        job->command = NULL;
+        job->output_fd = -1;
+        if (background)                                                 // Outlives the line, so it can't point into it
+        {
+                size_t length = 1;
+                for (int i = 0; i < pipeline->stage_count; i++)
+                {
+                        for (int j = 0; j < pipeline->stages[i].argc; j++)
                         {
-                                handle_cd(single_command);
-                                continue;
+                                length += strlen(pipeline->stages[i].argv[j]) + 1;
                         }
-                        if (strcmp("path", single_command[0]) == 0)
+                        for (int j = 0; j < pipeline->stages[i].output_count; j++)
                         {
-                                handle_path(single_command);
-                                continue;
+                                length += strlen(pipeline->stages[i].output_files[j]) + 3;
                         }
-                        
-                        int has_pipe = 0;
-                        for (int i = 0 ; single_command[i] != NULL; i++)
+                        length += pipeline->stages[i].input_file ? strlen(pipeline->stages[i].input_file) + 3 : 0;
+                        length += 4;                            // "| ", or "|+ (" / ", " / ") "
+                }
+                job->command = malloc(length);
+                if (job->command != NULL)
+                {
+                        job->command[0] = '\0';
+                        for (int i = 0; i < pipeline->stage_count; i++)
                         {
-                                if (strcmp(single_command[i], "|") == 0)
+                                for (int j = 0; j < pipeline->stages[i].argc; j++)
                                 {
-                                        has_pipe = 1;
-                                        break;
+                                        strcat(job->command, pipeline->stages[i].argv[j]);
+                                        strcat(job->command, " ");
                                 }
-                        }
-
-                        // has a pipe in the external command
-                        if (has_pipe)
-                        {
-                                execute_piped_command(single_command);
-                        }
-                        else
-                        {
-                                // default execution code
-                                // Single child process for now.
-                                pid_t process = fork();
-                                if (process < 0)
+                                if (pipeline->stages[i].input_file != NULL)
                                 {
-                                        printf("fork failed\n");
+                                        strcat(job->command, "< ");
+                                        strcat(job->command, pipeline->stages[i].input_file);
+                                        strcat(job->command, " ");
                                 }
-                                else if (process == 0)
+                                for (int j = 0; j < pipeline->stages[i].output_count; j++)
                                 {
-                                        char path[CONCAT_PATH_MAX] = {0};
-                                        select_search_path(path, single_command[0]);                          // finds suitable search path out of search_path
-                                
-                                        // check the final element of the command for |
-                                        // This signals the first element giving the output
-                                        configure_redirection(single_command);                        
-                                        execv(path, single_command);
-                                        
-                                        // if execv failed
-                                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                                        exit(1);                                                        // Exit the child process
+                                        strcat(job->command, "> ");
+                                        strcat(job->command, pipeline->stages[i].output_files[j]);
+                                        strcat(job->command, " ");
+                                }
+                                int producer = pipeline->stage_count - 1 - pipeline->consumer_count;
+                                if (i > producer)                       // |+ consumers: "a |+ (b, c)"
+                                {
+                                        job->command[strlen(job->command) - 1] = '\0';
+                                        strcat(job->command, i < pipeline->stage_count - 1 ? ", " : ") ");
+                                }
+                                else if (i == producer && pipeline->consumer_count > 0)
+                                {
+                                        strcat(job->command, "|+ (");
+                                }
+                                else if (i < pipeline->stage_count - 1)
+                                {
+                                        strcat(job->command, "| ");
                                 }
                         }
+                        job->command[strlen(job->command) - 1] = '\0';  // Trailing space
                 }
-                // Note: Should free the entire args block together, since all allocated memory are here
-                // Free the args block
-                while (wait(NULL) > 0);
-                free_args_elements(args);
-                free(args);
-                number_of_args = 0;
         }
-        // Free global vars at the end
-        // free_nested_arr(search_paths);
-        free_search_paths();
-        free(input);
+        line_running_jobs++;
+        return index;
 }
 
 
-////// FORMATTING
+// add_job_process - records a process started for the job (role: PROCESS_* bits), and puts it in the job's process group.
+// The first one leads the group. The child joins it by itself too (see spawn_child), whichever runs first.
+void add_job_process(struct Job* job, pid_t pid, int role)
+{
+        if (job->pid_count == job->pid_capacity)
+        {
+                int new_capacity = job->pid_capacity ? job->pid_capacity * 2 : 4;
+                pid_t* grown = realloc(job->pids, new_capacity * sizeof(pid_t));
+                unsigned char* grown_roles = grown ? realloc(job->roles, new_capacity) : NULL;
+                if (grown != NULL)
+                {
+                        job->pids = grown;
+                }
+                if (grown_roles == NULL)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        exit(1);
+                }
+                job->roles = grown_roles;
+                job->pid_capacity = new_capacity;
+        }
+        job->pids[job->pid_count] = pid;
+        job->roles[job->pid_count++] = role;
+        job->remaining++;
+        job->processes_left++;
+        job->sinks_left += (role & PROCESS_SINK) != 0;
+        int leader = job->pgid == 0;
+        job->pgid = leader ? pid : job->pgid;
+        setpgid(pid, job->pgid);                                        // EACCES once it has exec'd: it's already in
+        if (leader && !job->background && terminal_job == -1)
+        {
+                give_terminal(job - jobs);
+        }
+}
+
+
+// finish_job - a job with nothing left running is done, its status becomes the line's if it's the line's last job.
+// Foreground jobs give their slot back right away, background jobs keep it until they have been reported.
+void finish_job(int index)
+{
+        struct Job* job = &jobs[index];
+        job->state = JOB_DONE;
+        if (index == terminal_job)
+        {
+                pass_terminal();
+        }
+        if (job->output_fd != -1)
+        {
+                collate_output(job->output_group, job->output_fd);
+                job->output_fd = -1;
+        }
+        if (job->line == lines_launched)
+        {
+                line_running_jobs--;
+                if (index == line_last_job)
+                {
+                        last_status = job->status;
+                }
+        }
+        if (!job->background)
+        {
+                release_job(index);
+        }
+}
+
+
+// release_job - frees a finished job's slot
+void release_job(int index)
+{
+        free(jobs[index].command);
+        jobs[index].command = NULL;
+        jobs[index].state = JOB_FREE;
+}
+
+
+// start_reaper - routes SIGCHLD through a signalfd the reaper sleeps on with epoll (Linux)
+void start_reaper()
+{
+        sigprocmask(SIG_SETMASK, NULL, &original_signal_mask);
+        struct sigaction interrupt;
+        sigaction(SIGINT, NULL, &interrupt);
+        watch_interrupts = interrupt.sa_handler != SIG_IGN;            // An ignored SIGINT stays ignored, in the shell and its children
+#ifdef __linux__
+        sigset_t child_signal;                                          // and SIGINT, which reaches the shell the same way (see JOB CONTROL)
+        sigemptyset(&child_signal);
+        sigaddset(&child_signal, SIGCHLD);
+        if (watch_interrupts)
+        {
+                sigaddset(&child_signal, SIGINT);
+        }
+        sigprocmask(SIG_BLOCK, &child_signal, NULL);
+        child_signal_fd = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+        reaper_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = child_signal_fd};
+        if (child_signal_fd == -1 || reaper_epoll_fd == -1 || epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, child_signal_fd, &event) == -1)
+        {
+                stop_reaper();                                          // Blocking wait4 still works
+        }
+        struct epoll_event timer = {.events = EPOLLIN, .data.fd = metrics_timer_fd};
+        if (reaper_epoll_fd != -1 && metrics_timer_fd != -1)           // Periodic metrics while it waits (see METRICS)
+        {
+                epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, metrics_timer_fd, &timer);
+        }
+#endif
+        if (child_signal_fd == -1 && watch_interrupts)
+        {
+                struct sigaction handler = {.sa_handler = note_interrupt, .sa_flags = SA_RESTART};
+                sigemptyset(&handler.sa_mask);
+                sigaction(SIGINT, &handler, NULL);
+        }
+}
+
+
+// stop_reaper - closes the reaper's fds and unblocks SIGCHLD again
+void stop_reaper()
+{
+        if (child_signal_fd != -1)
+        {
+                close(child_signal_fd);
+                child_signal_fd = -1;
+        }
+        if (reaper_epoll_fd != -1)
+        {
+                close(reaper_epoll_fd);
+                reaper_epoll_fd = -1;
+        }
+        sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+}
+
+
+// reap_children - credits every child that has exited (and filter thread that has finished) to its job.
+// With block, first sleeps until one has.
+void reap_children(int block)
+{
+        int reaped_any = 0;
+        while (1)
+        {
+                int status;
+                struct rusage usage;
+                int sleep_in_wait = block && !reaped_any && reaper_epoll_fd == -1;
+                pid_t pid = wait4(-1, &status, (sleep_in_wait ? 0 : WNOHANG) | WUNTRACED, &usage);
+                if (interrupt_pending)
+                {
+                        interrupt_pending = 0;
+                        interrupt_line();
+                }
+                if (pid > 0 && WIFSTOPPED(status))
+                {
+                        resume_stopped(pid, WSTOPSIG(status));
+                        continue;
+                }
+                if (pid > 0)
+                {
+                        trace_reap(pid, decode_status(status));
+                        time_reaped(pid, &usage);
+                        credit_process(pid, status, &usage);
+                        reaped_any = 1;
+                        continue;
+                }
+                if (pid == -1 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (collect_filters() > 0)
+                {
+                        reaped_any = 1;
+                }
+                if (pid == -1 && running_filters == NULL)               // Case: no children or filters at all, nothing can still be running
+                {
+                        for (int i = 0; i < job_slots; i++)
+                        {
+                                if (jobs[i].state == JOB_RUNNING)
+                                {
+                                        finish_job(i);
+                                }
+                        }
+                        return;
+                }
+                if (!block || reaped_any)                               // Case: the rest are still running
+                {
+                        return;
+                }
+#ifdef __linux__
+                struct epoll_event event;
+                if (epoll_wait(reaper_epoll_fd, &event, 1, -1) > 0 && event.data.fd == metrics_timer_fd)
+                {
+                        uint64_t expirations;                           // Drained, or it would keep waking the reaper
+                        read(metrics_timer_fd, &expirations, sizeof(expirations));
+                        write_metrics_if_due();
+                }
+                else
+                {
+                        check_interrupts(0);                            // SIGCHLD is only a wakeup: they coalesce, the wait4 loop finds every child
+                }
+#endif
+        }
+}
+
+
+// credit_process - records an exited process against its job
+void credit_process(pid_t pid, int status, struct rusage* usage)
+{
+        for (int i = 0; i < job_slots; i++)
+        {
+                struct Job* job = &jobs[i];
+                for (int j = 0; job->state == JOB_RUNNING && j < job->pid_count; j++)
+                {
+                        if (job->pids[j] == pid)
+                        {
+                                job->processes_left--;
+                                if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT && (i == terminal_job || !job->background))
+                                {
+                                        interrupt_line();               // Ctrl-C went to the job with the terminal: the rest of the line goes too
+                                }
+                                credit_job(i, usage, job->roles[j], decode_status(status));
+                                return;
+                        }
+                }
+        }
+}
+
+
+// credit_job - adds up a finished process (or filter thread) of a job, and finishes the job after the last one.
+// Once nothing is left that writes the job's final output, whatever still runs upstream gets a SIGPIPE.
+void credit_job(int index, struct rusage* usage, int role, int exit_status)
+{
+        struct Job* job = &jobs[index];
+        timeradd(&job->usage.ru_utime, &usage->ru_utime, &job->usage.ru_utime);
+        timeradd(&job->usage.ru_stime, &usage->ru_stime, &job->usage.ru_stime);
+        if (usage->ru_maxrss > job->usage.ru_maxrss)
+        {
+                job->usage.ru_maxrss = usage->ru_maxrss;
+        }
+        if (role & PROCESS_LAST_STAGE)
+        {
+                job->status = exit_status;
+        }
+        if ((role & PROCESS_SINK) && --job->sinks_left == 0 && job->remaining > 1 && job->processes_left > 0)
+        {
+                killpg(job->pgid, SIGPIPE);                             // Nobody reads it anymore, don't let it run on
+        }
+        if (--job->remaining == 0)
+        {
+                finish_job(index);
+        }
+}
+
+
+// wait_for_job_slot - blocks until the line being launched has fewer than max_jobs jobs running
+void wait_for_job_slot()
+{
+        while (line_running_jobs >= max_jobs)
+        {
+                reap_children(1);
+        }
+}
+
+
+// wait_for_job - waits for a background job and frees its slot, returns its exit status
+int wait_for_job(int index)
+{
+        while (jobs[index].state == JOB_RUNNING)
+        {
+                reap_children(1);
+        }
+        int status = jobs[index].status;
+        release_job(index);
+        return status;
+}
+
+
+// find_job - background job by "N" or "%N" (as printed by jobs), or the latest one for NULL. -1 if there is none.
+int find_job(const char* spec)
+{
+        if (spec == NULL)
+        {
+                int latest = -1;
+                for (int i = 0; i < job_slots; i++)
+                {
+                        if (jobs[i].state != JOB_FREE && jobs[i].background && (latest == -1 || jobs[i].started > jobs[latest].started))
+                        {
+                                latest = i;
+                        }
+                }
+                return latest;
+        }
+        char* end;
+        long number = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+        if (*end != '\0' || number < 1 || number > job_slots || jobs[number - 1].state == JOB_FREE || !jobs[number - 1].background)
+        {
+                return -1;
+        }
+        return number - 1;
+}
+
+
+// print_job - one line of `jobs`: "[1]  Running  sleep 10", finished jobs with their status and resource usage
+void print_job(int index, int out)
+{
+        struct Job* job = &jobs[index];
+        const char* command = job->command ? job->command : "";
+        if (job->state == JOB_RUNNING)
+        {
+                dprintf(out, "[%d]  Running  %s\n", index + 1, command);
+                return;
+        }
+        dprintf(out, "[%d]  Done (%d)  %s  (%ld.%03lds user, %ld.%03lds sys, %ld KB max rss)\n", index + 1, job->status, command,
+               (long) job->usage.ru_utime.tv_sec, (long) job->usage.ru_utime.tv_usec / 1000,
+               (long) job->usage.ru_stime.tv_sec, (long) job->usage.ru_stime.tv_usec / 1000, job->usage.ru_maxrss);
+}
+
+
+// report_finished_jobs - prints and frees every background job that is done, before a prompt
+void report_finished_jobs()
+{
+        reap_children(0);
+        for (int i = 0; i < job_slots; i++)
+        {
+                if (jobs[i].state == JOB_DONE && jobs[i].background)
+                {
+                        print_job(i, STDOUT_FILENO);
+                        release_job(i);
+                }
+        }
+}
+
+
+// free_jobs - releases the job table
+void free_jobs()
+{
+        for (int i = 0; i < job_slots; i++)
+        {
+                free(jobs[i].pids);
+                free(jobs[i].roles);
+                free(jobs[i].command);
+        }
+        free(jobs);
+        jobs = NULL;
+        job_slots = 0;
+}
+
+
+// handle_jobs - lists background jobs, finished ones are forgotten once listed
+int handle_jobs(char **args, int out)
+{
+        if (args[1] != NULL)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        reap_children(0);
+        for (int i = 0; i < job_slots; i++)
+        {
+                if (jobs[i].state != JOB_FREE && jobs[i].background)
+                {
+                        print_job(i, out);
+                        if (jobs[i].state == JOB_DONE)
+                        {
+                                release_job(i);
+                        }
+                }
+        }
+        return 0;
+}
+
+
+// handle_wait - `wait` waits for every background job, `wait N` for job N and takes its exit status
+int handle_wait(char **args, int out)
+{
+        if (args[1] == NULL)
+        {
+                for (int i = 0; i < job_slots; i++)
+                {
+                        if (jobs[i].state != JOB_FREE && jobs[i].background)
+                        {
+                                wait_for_job(i);
+                        }
+                }
+                return 0;
+        }
+        int status = 0;
+        for (int i = 1; args[i] != NULL; i++)
+        {
+                int index = find_job(args[i]);
+                if (index == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        status = 127;
+                        continue;
+                }
+                status = wait_for_job(index);
+        }
+        return status;
+}
+
+
+// handle_fg - `fg [N]` brings job N (default: the latest) to the foreground: prints it and waits for it
+int handle_fg(char **args, int out)
+{
+        int index = args[1] == NULL || args[2] == NULL ? find_job(args[1]) : -1;
+        if (index == -1)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        dprintf(out, "%s\n", jobs[index].command ? jobs[index].command : "");
+        give_terminal(index);                                           // Ctrl-C now goes to it (see JOB CONTROL)
+        return wait_for_job(index);
+}
+
+
+// parse_job_limit - "N" -> N for -j and maxjobs, -1 unless it is a whole number >= 1
+int parse_job_limit(const char* text)
+{
+        char* end;
+        errno = 0;
+        long limit = strtol(text, &end, 10);
+        if (end == text || *end != '\0' || errno != 0 || limit < 1 || limit > 1000000)
+        {
+                return -1;
+        }
+        return limit;
+}
+
+
+// handle_maxjobs - `maxjobs` prints the job limit, `maxjobs N` sets it
+int handle_maxjobs(char **args, int out)
+{
+        if (args[1] == NULL)
+        {
+                dprintf(out, "%d\n", max_jobs);
+                return 0;
+        }
+        int limit = args[2] == NULL ? parse_job_limit(args[1]) : -1;
+        if (limit == -1)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        max_jobs = limit;
+        return 0;
+}
+
+
+////// JOB CONTROL
+
+// Every job runs in a process group of its own: all its stages and helpers join the group its first process leads
+// (add_job_process, and spawn_child / posix_spawn attributes in the child, whichever runs first).
+// If the shell was started in the foreground of a terminal, the terminal is handed to the line's foreground jobs one
+// at a time (the first one started; when it's done, the next one still running), so Ctrl-C goes to that job and
+// never to the shell, and programs that read the terminal (ssh, man, vim) still can. When a foreground job dies of
+// SIGINT, interrupt_line sends one to every other foreground job of the line too, and nothing more of it is started.
+// Without a terminal, SIGINT reaches the shell itself: it is read from the reaper's signalfd (a handler elsewhere)
+// and forwarded the same way. Scripts and -c stop at an interrupted line with status 130, at the prompt the shell
+// just carries on. Background jobs (trailing &) are never interrupted.
+// A pipeline is torn down once nothing is left that writes its final output (the last stage, every |+ consumer, and
+// their tee helpers): whatever still runs upstream gets a SIGPIPE, instead of working on until its next write.
+// qish doesn't suspend jobs, Ctrl-Z'd ones are continued right away.
+
+// start_job_control - the terminal is handed around only if the shell is in its foreground
+void start_job_control()
+{
+        int fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (fd != -1 && tcgetpgrp(fd) == getpgrp())
+        {
+                terminal_fd = fd;
+                signal(SIGTTOU, SIG_IGN);                               // Taking the terminal back from the background
+                return;
+        }
+        if (fd != -1)
+        {
+                close(fd);
+        }
+}
+
+
+// give_terminal - makes job index the foreground job (-1: the shell) and hands it the terminal. The job is
+// continued too, in case it stopped on reading the terminal before it was its turn.
+void give_terminal(int index)
+{
+        terminal_job = index;
+        if (terminal_fd == -1)
+        {
+                return;
+        }
+        if (index == -1)
+        {
+                tcsetpgrp(terminal_fd, getpgrp());
+                return;
+        }
+        if (jobs[index].processes_left > 0)                             // Filter threads alone have no group
+        {
+                tcsetpgrp(terminal_fd, jobs[index].pgid);
+                killpg(jobs[index].pgid, SIGCONT);
+        }
+}
+
+
+// pass_terminal - the foreground job is done: the line's earliest started foreground job still running is next
+void pass_terminal()
+{
+        int next = -1;
+        for (int i = 0; i < job_slots; i++)
+        {
+                struct Job* job = &jobs[i];
+                if (job->state == JOB_RUNNING && !job->background && job->line == lines_launched && job->processes_left > 0
+                        && (next == -1 || job->started < jobs[next].started))
+                {
+                        next = i;
+                }
+        }
+        give_terminal(next);
+}
+
+
+// interrupt_line - Ctrl-C: SIGINT to every foreground job of the line (and the one `fg` waits for), and nothing
+// more of the line is started
+void interrupt_line()
+{
+        if (line_interrupted)
+        {
+                return;
+        }
+        line_interrupted = 1;
+        for (int i = 0; i < job_slots; i++)
+        {
+                struct Job* job = &jobs[i];
+                if (job->state == JOB_RUNNING && job->processes_left > 0 && (i == terminal_job || (!job->background && job->line == lines_launched)))
+                {
+                        killpg(job->pgid, SIGINT);
+                }
+        }
+}
+
+
+// check_interrupts - empties the reaper's signalfd: a SIGINT in it interrupts the line, unless discard
+void check_interrupts(int discard)
+{
+        int interrupted = interrupt_pending;
+        interrupt_pending = 0;
+#ifdef __linux__
+        struct signalfd_siginfo signals[16];
+        ssize_t got;
+        while (child_signal_fd != -1 && (got = read(child_signal_fd, signals, sizeof(signals))) > 0)
+        {
+                for (size_t i = 0; i < got / sizeof(signals[0]); i++)
+                {
+                        interrupted |= signals[i].ssi_signo == SIGINT;
+                }
+        }
+#endif
+        if (interrupted && !discard)
+        {
+                interrupt_line();
+        }
+}
+
+
+// note_interrupt - SIGINT handler where there's no signalfd, the reaper acts on it
+void note_interrupt(int signal)
+{
+        (void) signal;
+        interrupt_pending = 1;
+}
+
+
+// resume_stopped - a child stopped (wait4 WUNTRACED). Ctrl-Z'd ones are continued, as are ones that stopped
+// reading the terminal although their job has it (they tried before it was handed over). Anything else stays
+// stopped: a job waiting for its turn at the terminal is continued by give_terminal.
+void resume_stopped(pid_t pid, int signal)
+{
+        for (int i = 0; i < job_slots; i++)
+        {
+                struct Job* job = &jobs[i];
+                for (int j = 0; job->state == JOB_RUNNING && j < job->pid_count; j++)
+                {
+                        if (job->pids[j] != pid)
+                        {
+                                continue;
+                        }
+                        int has_terminal = terminal_fd != -1 && tcgetpgrp(terminal_fd) == job->pgid;
+                        if (signal == SIGTSTP || ((signal == SIGTTIN || signal == SIGTTOU) && has_terminal))
+                        {
+                                kill(pid, SIGCONT);
+                        }
+                        return;
+                }
+        }
+}
+
+
+// reset_child_signals - in a new process: the signal mask, SIGINT and SIGTTOU the way the shell found them
+void reset_child_signals()
+{
+        sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+        if (watch_interrupts)
+        {
+                signal(SIGINT, SIG_DFL);
+        }
+        if (terminal_fd != -1)
+        {
+                signal(SIGTTOU, SIG_DFL);
+        }
+}
+
+
+////// OUTPUT COLLATION
+
+// With -o order or -o finish (or QISH_COLLATE), the & groups of a line don't share the terminal: each one's stdout
+// goes into its own memfd (an unlinked temp file elsewhere), and a whole group's output is copied to the shell's
+// stdout at once, either in command order (like GNU parallel --keep-order: a group is printed as soon as every
+// group before it has been) or in completion order. Nothing is interleaved, and the jobs never contend on one pipe
+// or tty. Builtins and copies are done as soon as they ran. stderr isn't collated. Lines with a single group, and
+// background lines, are left alone.
+
+// select_collate_mode - sets collate_mode by name, -1 if there's no such mode
+int select_collate_mode(const char* name)
+{
+        for (int i = 0; collate_mode_names[i] != NULL; i++)
+        {
+                if (strcmp(collate_mode_names[i], name) == 0)
+                {
+                        collate_mode = i;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+
+// start_collation - sets up the outputs of the line being launched, group_count 0 if it isn't collated
+void start_collation(int group_count)
+{
+        line_outputs = NULL;
+        line_output_count = group_count;
+        line_outputs_printed = 0;
+        if (group_count == 0)
+        {
+                return;
+        }
+        line_outputs = arena_alloc(line_arena, group_count * sizeof(int));
+        for (int i = 0; i < group_count; i++)
+        {
+                line_outputs[i] = OUTPUT_PENDING;
+        }
+}
+
+
+// open_output_buffer - an anonymous file for a group's output, -1 if there is none (it then writes to stdout)
+int open_output_buffer()
+{
+#ifdef __linux__
+        int fd = memfd_create("qish-output", MFD_CLOEXEC);
+        if (fd != -1)
+        {
+                return fd;
+        }
+#endif
+        char path[] = "/tmp/qish-output-XXXXXX";
+        int temporary = mkstemp(path);
+        if (temporary != -1)
+        {
+                unlink(path);
+                fcntl(temporary, F_SETFD, FD_CLOEXEC);
+        }
+        return temporary;
+}
+
+
+// collate_output - a group is done, fd holds its output (-1: nothing to print). Prints whatever may be printed now.
+void collate_output(int group, int fd)
+{
+        if (line_outputs == NULL)
+        {
+                return;
+        }
+        line_outputs[group] = fd != -1 ? fd : OUTPUT_NONE;
+        if (collate_mode == COLLATE_FINISH)
+        {
+                print_output(group);
+                return;
+        }
+        while (line_outputs_printed < line_output_count && line_outputs[line_outputs_printed] != OUTPUT_PENDING)
+        {
+                print_output(line_outputs_printed++);
+        }
+}
+
+
+// print_output - copies a finished group's buffer to stdout (in the kernel where it can, see copy_file) and closes it
+void print_output(int group)
+{
+        int fd = line_outputs[group];
+        line_outputs[group] = OUTPUT_NONE;
+        if (fd < 0)
+        {
+                return;
+        }
+        double printing = trace_now();
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && lseek(fd, 0, SEEK_SET) == 0)
+        {
+                copy_file(fd, STDOUT_FILENO, &info, 0);
+        }
+        close(fd);
+        trace_span("print output", "output", printing);
+}
+
+
+// decode_status - wait status -> shell exit status (128 + signal for killed children)
+int decode_status(int status)
+{
+        if (WIFEXITED(status))
+        {
+                return WEXITSTATUS(status);
+        }
+        if (WIFSIGNALED(status))
+        {
+                return 128 + WTERMSIG(status);
+        }
+        return 1;
+}
+
+
+// free_shell_memory - releases everything the shell holds before it exits
+void free_shell_memory()
+{
+        free_search_paths();
+        clear_command_hash();
+        arena_free(&line_arenas[0]);
+        arena_free(&line_arenas[1]);
+        arena_free(&bench_arena);
+        free_jobs();
+        stop_reaper();
+        if (terminal_fd != -1)
+        {
+                close(terminal_fd);
+        }
+        close_script(&script);
+        free(input_buffer);
+        write_trace();
+        stop_metrics();
+}
+
+
+////// BATCH SCRIPTS
+
+// A script file is mapped (MAP_PRIVATE, so words can be NUL terminated in place without touching the file) and
+// lines are sliced straight out of the mapping: no copy into a line buffer and no read per line. Scripts that
+// can't be mapped (pipes, /dev/stdin) are read SCRIPT_READ_SIZE at a time into a buffer instead.
+// run_script keeps two lines in flight: once line N's processes are started, line N+1 is parsed (into the other
+// arena) while they run, so it's ready to launch the moment line N has been reaped.
+
+// open_script - maps path, or falls back to reading it in blocks, -1 if it can't be opened
+int open_script(struct Script* script, const char* path)
+{
+        *script = (struct Script){.fd = open(path, O_RDONLY | O_CLOEXEC)};
+        if (script->fd == -1)
+        {
+                return -1;
+        }
+        struct stat info;
+        if (fstat(script->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        {
+                void* data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, script->fd, 0);
+                if (data != MAP_FAILED)
+                {
+                        madvise(data, info.st_size, MADV_SEQUENTIAL);
+                        script->data = data;
+                        script->length = info.st_size;
+                        close(script->fd);
+                        script->fd = -1;
+                        return 0;
+                }
+        }
+        script->capacity = SCRIPT_READ_SIZE;
+        script->data = malloc(script->capacity);
+        if (script->data == NULL)
+        {
+                close(script->fd);
+                return -1;
+        }
+        return 0;
+}
+
+
+// fill_script_buffer - reads more of an unmappable script, keeping data[position..length). 0 once at EOF.
+// Moves the unread part to the front of the buffer, so lines handed out before are gone (they have been launched).
+int fill_script_buffer(struct Script* script)
+{
+        if (script->at_eof)
+        {
+                return 0;
+        }
+        memmove(script->data, script->data + script->position, script->length - script->position);
+        script->length -= script->position;
+        script->position = 0;
+        if (script->capacity - script->length < SCRIPT_READ_SIZE)      // Case: a line longer than the buffer
+        {
+                char* grown = realloc(script->data, script->capacity * 2);
+                if (grown == NULL)
+                {
+                        script->at_eof = 1;
+                        return 0;
+                }
+                script->data = grown;
+                script->capacity *= 2;
+        }
+        ssize_t bytes_read;
+        while ((bytes_read = read(script->fd, script->data + script->length, script->capacity - script->length - 1)) == -1 && errno == EINTR)
+        {
+        }
+        if (bytes_read <= 0)
+        {
+                script->at_eof = 1;
+                return 0;
+        }
+        script->length += bytes_read;
+        return 1;
+}
+
+
+// next_script_line - the next line (with its \n) and its length, NULL at the end of the script.
+// The line stays valid until the line after the next one is asked for; it has a writable byte after it, like getline's.
+char* next_script_line(struct Script* script, size_t* length)
+{
+        char* newline;
+        while ((newline = memchr(script->data + script->position, '\n', script->length - script->position)) == NULL)
+        {
+                if (script->capacity == 0 || !fill_script_buffer(script))
+                {
+                        break;
+                }
+        }
+        char* line = script->data + script->position;
+        if (newline != NULL)
+        {
+                *length = newline + 1 - line;
+                script->position += *length;
+                return line;
+        }
+        // Unterminated last line
+        *length = script->length - script->position;
+        script->position = script->length;
+        if (*length == 0)
+        {
+                return NULL;
+        }
+        if (script->capacity != 0)                                      // The read buffer always keeps a spare byte
+        {
+                line[*length] = '\0';
+                return line;
+        }
+        free(script->last_line);                                        // The mapping may end right after it
+        script->last_line = malloc(*length + 1);
+        if (script->last_line == NULL)
+        {
+                return NULL;
+        }
+        memcpy(script->last_line, line, *length);
+        script->last_line[*length] = '\0';
+        return script->last_line;
+}
+
+
+// close_script - unmaps or frees the script
+void close_script(struct Script* script)
+{
+        if (script->data != NULL)
+        {
+                if (script->capacity == 0)
+                {
+                        munmap(script->data, script->length);
+                }
+                else
+                {
+                        free(script->data);
+                }
+        }
+        if (script->fd != -1)
+        {
+                close(script->fd);
+        }
+        free(script->last_line);
+        *script = (struct Script){.fd = -1};
+}
+
+
+// run_script - runs every line of the script, parsing each one while the line before it runs
+void run_script(struct Script* script)
+{
+        int current = 0;
+        size_t length;
+        double reading = trace_now();
+        char* input = next_script_line(script, &length);
+        trace_span("read line", "input", reading);
+        if (input != NULL)
+        {
+                line_arena = &line_arenas[current];
+                parse_line(input, length, &command_lines[current]);
+        }
+        while (input != NULL)
+        {
+                line_arena = &line_arenas[current];
+                launch_line(&command_lines[current]);
+
+                int next = !current;
+                reading = trace_now();
+                input = next_script_line(script, &length);
+                trace_span("read line", "input", reading);
+                if (input != NULL)
+                {
+                        line_arena = &line_arenas[next];
+                        parse_line(input, length, &command_lines[next]);
+                }
+
+                wait_line(&command_lines[current]);
+                arena_reset(&line_arenas[current]);
+                current = next;
+        }
+}
+
+
+////// ARENA
+
+// Bump allocator that owns everything allocated for one command line: the parse tables and the spawn actions.
+// Allocating is a pointer bump, and the whole line is released at once by arena_reset, which only rewinds to the
+// first block. Blocks are kept for the next line, so a long batch session stops touching malloc once the arena
+// has grown to fit its biggest line. Anything that outlives the line (e.g. the command hash) uses malloc instead.
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+struct ArenaBlock {
+        struct ArenaBlock* next;
+        size_t size;                    // usable bytes in data
+        size_t used;
+        _Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+
+size_t arena_round(size_t size)
+{
+        return (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+}
+
+
+// arena_alloc - size bytes, aligned for any type. Moves on to (or adds) another block when the current one is full.
+void* arena_alloc(struct Arena* arena, size_t size)
+{
+        size = arena_round(size);
+        struct ArenaBlock* block = arena->current;
+        if (block == NULL || block->used + size > block->size)
+        {
+                if (block != NULL && block->next != NULL && block->next->size >= size)
+                {
+                        block = block->next;                            // Reuse a block kept from an earlier line
+                }
+                else
+                {
+                        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+                        struct ArenaBlock* fresh = malloc(sizeof(struct ArenaBlock) + block_size);
+                        if (fresh == NULL)
+                        {
+                                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                exit(1);
+                        }
+                        fresh->size = block_size;
+                        if (block == NULL)
+                        {
+                                fresh->next = NULL;
+                                arena->first = fresh;
+                        }
+                        else
+                        {
+                                fresh->next = block->next;
+                                block->next = fresh;
+                        }
+                        block = fresh;
+                }
+                block->used = 0;
+                arena->current = block;
+        }
+        void* memory = block->data + block->used;
+        block->used += size;
+        return memory;
+}
+
+
+// arena_grow - resizes the most recent allocation in place when it can, otherwise copies it to a bigger one
+void* arena_grow(struct Arena* arena, void* old, size_t old_size, size_t new_size)
+{
+        struct ArenaBlock* block = arena->current;
+        if (old != NULL && block != NULL && (char*) old + arena_round(old_size) == block->data + block->used
+                && (char*) old - block->data + arena_round(new_size) <= block->size)
+        {
+                block->used = (char*) old - block->data + arena_round(new_size);
+                return old;
+        }
+        void* memory = arena_alloc(arena, new_size);
+        if (old != NULL)
+        {
+                memcpy(memory, old, old_size);
+        }
+        return memory;
+}
+
+
+// arena_reset - frees everything allocated since the last reset, in O(1)
+void arena_reset(struct Arena* arena)
+{
+        arena->current = arena->first;
+        if (arena->first != NULL)
+        {
+                arena->first->used = 0;
+        }
+}
+
+
+// arena_free - gives every block back to malloc (on the way out)
+void arena_free(struct Arena* arena)
+{
+        struct ArenaBlock* block = arena->first;
+        while (block != NULL)
+        {
+                struct ArenaBlock* next = block->next;
+                free(block);
+                block = next;
+        }
+        arena->first = NULL;
+        arena->current = NULL;
+}
+
+
+////// PARSING
+
+// A line is lexed and parsed in one pass over the input buffer, into:
+//   CommandLine -> Pipelines (one per & group) -> Stages (one per | segment) -> argv + > target + < source
+// Words are never copied: each word is NUL terminated in place (on the delimiter right after it, which has
+// already been classified by then) and argv points straight into the buffer. The tables live in line_arena, so
+// growing them is a pointer bump and they go away with the rest of the line.
+// The byte classes and the word scanner (SSE2/AVX2 where available, 16-32 bytes per step) are in scan.h.
+// E.g. "ls -l>out|wc &ls" -> {{"ls" "-l" >out} | {"wc"}} & {{"ls"}}
+// A broadcast pipe's consumers are the last stages of their pipeline: "a |+ (b, c)" -> {{"a"} {"b"} {"c"}}, consumer_count 2
+
+// grow_array - makes room for one more element in an array allocated from line_arena
+void grow_array(void** array, int* capacity, int count, size_t element_size)
+{
+        if (count < *capacity)
+        {
+                return;
+        }
+        int new_capacity = *capacity ? *capacity * 2 : 16;
+        *array = arena_grow(line_arena, *array, *capacity * element_size, new_capacity * element_size);
+        *capacity = new_capacity;
+}
+
+
+// start_stage - opens a new stage in the current pipeline
+void start_stage(struct CommandLine* line)
+{
+        grow_array((void**) &line->stages, &line->stage_capacity, line->stage_count, sizeof(struct Stage));
+        line->stages[line->stage_count++] = (struct Stage){NULL, 0, NULL, 0, 0, NULL, 0, line->arg_count};
+        line->pipelines[line->pipeline_count - 1].stage_count++;
+}
+
+
+// end_stage - NULL terminates the current stage's argv and checks its redirection
+void end_stage(struct CommandLine* line, int redirect_state)
+{
+        struct Stage* stage = &line->stages[line->stage_count - 1];
+        grow_array((void**) &line->args, &line->arg_capacity, line->arg_count, sizeof(char*));
+        line->args[line->arg_count++] = NULL;
+
+        if (redirect_state == REDIRECT_WANTS_FILE || redirect_state == REDIRECT_WANTS_INPUT)    // Case: > or < without a file after it
+        {
+                stage->error = 1;
+        }
+        if ((stage->output_count > 0 || stage->input_file != NULL) && stage->argc == 0)     // Case: > or < with no command before it
+        {
+                stage->error = 1;
+        }
+}
+
+
+// start_pipeline - opens a new & group, with its first stage
+void start_pipeline(struct CommandLine* line)
+{
+        grow_array((void**) &line->pipelines, &line->pipeline_capacity, line->pipeline_count, sizeof(struct Pipeline));
+        line->pipelines[line->pipeline_count++] = (struct Pipeline){NULL, 0, line->stage_count, 0};
+        start_stage(line);
+}
+
+
+// end_pipeline - closes the current & group. A group with nothing in it (e.g. "&" alone, or a trailing &) is dropped.
+void end_pipeline(struct CommandLine* line, int redirect_state)
+{
+        end_stage(line, redirect_state);
+
+        struct Pipeline* pipeline = &line->pipelines[line->pipeline_count - 1];
+        struct Stage* last = &line->stages[line->stage_count - 1];
+        if (pipeline->stage_count == 1 && last->argc == 0 && last->output_count == 0 && last->input_file == NULL && !last->error)
+        {
+                line->stage_count--;
+                line->arg_count--;
+                line->pipeline_count--;
+                return;
+        }
+        // Case: empty stage inside a pipeline ("ls | | wc", "ls |")
+        for (int i = pipeline->first_stage; i < line->stage_count; i++)
+        {
+                if (line->stages[i].argc == 0)
+                {
+                        line->stages[i].error = 1;
+                }
+        }
+}
+
+
+// parse_line - lexes and parses input (ending at its first \n or \0, or at length) into line. input is modified in place.
+// input[length] must be a writable byte: the last word is terminated on it.
+void parse_line(char* input, size_t length, struct CommandLine* line)
+{
+        *line = (struct CommandLine){0};                                // The previous line's tables went with the arena reset
+        double scanning = trace_now();
+
+        int redirect_state = REDIRECT_NONE;
+        int group_state = GROUP_NONE;                                   // Where we are in "|+ (c1, c2)"
+        int after_parallel = 0;                                         // Nothing but spaces since the last &
+        char* current = input;
+        char* end = input + length;
+        start_pipeline(line);
+
+        while (1)
+        {
+                const unsigned char* classes = (group_state == GROUP_WANTS_OPEN || group_state == GROUP_OPEN) ? group_char_classes : char_classes;
+                int class = current < end ? classes[(unsigned char) *current] : CHAR_END;
+                if (class == CHAR_WORD)
+                {
+                        after_parallel = 0;
+                        char* word = current;
+                        current = (char*) (classes == char_classes ? scan_word(current, end) : scan_group_word(current, end));
+                        class = current < end ? classes[(unsigned char) *current] : CHAR_END;
+                        *current = '\0';                                // The delimiter is already in class, terminate the word on it
+
+                        struct Stage* stage = &line->stages[line->stage_count - 1];
+                        if (group_state == GROUP_WANTS_OPEN || group_state == GROUP_CLOSED)    // Case: "a |+ b", "a |+ (b) c"
+                        {
+                                stage->error = 1;
+                        }
+                        else if (redirect_state == REDIRECT_WANTS_FILE)
+                        {
+                                grow_array((void**) &stage->output_files, &stage->output_capacity, stage->output_count, sizeof(char*));
+                                stage->output_files[stage->output_count++] = word;
+                                redirect_state = REDIRECT_DONE;
+                        }
+                        else if (redirect_state == REDIRECT_WANTS_INPUT)
+                        {
+                                stage->input_file = word;
+                                redirect_state = REDIRECT_DONE;
+                        }
+                        else if (redirect_state == REDIRECT_DONE)       // Case: more words after the file
+                        {
+                                stage->error = 1;
+                        }
+                        else
+                        {
+                                grow_array((void**) &line->args, &line->arg_capacity, line->arg_count, sizeof(char*));
+                                line->args[line->arg_count++] = word;
+                                stage->argc++;
+                        }
+                }
+
+                switch (class)
+                {
+                case CHAR_SPACE:
+                        break;
+                case CHAR_REDIRECT:
+                        after_parallel = 0;
+                        if (redirect_state == REDIRECT_WANTS_FILE || redirect_state == REDIRECT_WANTS_INPUT    // Case: "ls > > a"
+                                || group_state == GROUP_WANTS_OPEN || group_state == GROUP_CLOSED)
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                        }
+                        redirect_state = REDIRECT_WANTS_FILE;
+                        break;
+                case CHAR_INPUT:                                        // "< file" and "> file" can follow the words in either order
+                        after_parallel = 0;
+                        if (redirect_state == REDIRECT_WANTS_FILE || redirect_state == REDIRECT_WANTS_INPUT
+                                || group_state == GROUP_WANTS_OPEN || group_state == GROUP_CLOSED
+                                || line->stages[line->stage_count - 1].input_file != NULL)       // Case: multiple < in one stage
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                        }
+                        redirect_state = REDIRECT_WANTS_INPUT;
+                        break;
+                case CHAR_PIPE:
+                        after_parallel = 0;
+                        if (group_state != GROUP_NONE)                  // Case: a consumer list has to end its pipeline
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                                break;
+                        }
+                        end_stage(line, redirect_state);
+                        redirect_state = REDIRECT_NONE;
+                        if (current + 1 < end && current[1] == '+')     // Case: "|+", the consumer list comes next
+                        {
+                                current++;
+                                group_state = GROUP_WANTS_OPEN;
+                                break;
+                        }
+                        start_stage(line);
+                        break;
+                case CHAR_GROUP_OPEN:
+                        if (group_state != GROUP_WANTS_OPEN)            // Case: "|+ ((a)"
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                                break;
+                        }
+                        group_state = GROUP_OPEN;
+                        start_stage(line);
+                        line->pipelines[line->pipeline_count - 1].consumer_count = 1;
+                        break;
+                case CHAR_GROUP_NEXT:
+                        end_stage(line, redirect_state);
+                        start_stage(line);
+                        line->pipelines[line->pipeline_count - 1].consumer_count++;
+                        redirect_state = REDIRECT_NONE;
+                        break;
+                case CHAR_GROUP_CLOSE:                                  // The last consumer is ended with its pipeline
+                        group_state = GROUP_CLOSED;
+                        break;
+                case CHAR_PARALLEL:
+                        after_parallel = 1;
+                        if (group_state == GROUP_WANTS_OPEN || group_state == GROUP_OPEN)      // Case: "a |+ (b &"
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                        }
+                        end_pipeline(line, redirect_state);
+                        start_pipeline(line);
+                        redirect_state = REDIRECT_NONE;
+                        group_state = GROUP_NONE;
+                        break;
+                case CHAR_END:
+                        if (group_state == GROUP_WANTS_OPEN || group_state == GROUP_OPEN)      // Case: "a |+", "a |+ (b"
+                        {
+                                line->stages[line->stage_count - 1].error = 1;
+                        }
+                        end_pipeline(line, redirect_state);
+                        line->background = after_parallel && line->pipeline_count > 0;     // "a & b &"
+                        trace_span("scan", "parse", scanning);
+                        double linking = trace_now();
+                        link_command_line(line);
+                        trace_span("link", "parse", linking);
+                        return;
+                }
+                current++;
+        }
+}
+
+
+// link_command_line - the tables may have moved while growing, so pointers are only set once the line is parsed
+void link_command_line(struct CommandLine* line)
+{
+        for (int i = 0; i < line->pipeline_count; i++)
+        {
+                line->pipelines[i].stages = &line->stages[line->pipelines[i].first_stage];
+        }
+        for (int i = 0; i < line->stage_count; i++)
+        {
+                line->stages[i].argv = &line->args[line->stages[i].first_arg];
+        }
+
+        // time a | b & c: the whole line is timed. "time" alone times nothing, "time | b" and "time > f" are malformed.
+        // bench [-n N] [-w W] [--] a | b & c: the whole line is run over and over (see BENCH). Either can come first.
+        struct Stage* first = line->stage_count > 0 ? &line->stages[0] : NULL;
+        while (first != NULL && first->argc > 0)
+        {
+                if (strcmp(first->argv[0], "time") == 0 && !line->timed)
+                {
+                        line->timed = 1;
+                        first->argv++;
+                        first->argc--;
+                }
+                else if (strcmp(first->argv[0], "bench") == 0 && line->bench_runs == 0)
+                {
+                        if (parse_bench_prefix(line, first) == -1)
+                        {
+                                break;
+                        }
+                }
+                else
+                {
+                        break;
+                }
+        }
+        if (line->bench_runs != 0)
+        {
+                // Case: bad options, nothing to run, a background bench, or a bench of a bench
+                int malformed = line->bench_runs == -1 || first->argc == 0 || strcmp(first->argv[0], "bench") == 0
+                        || line->background || benchmarking;
+                for (int i = 0; i < line->stage_count; i++)
+                {
+                        malformed |= line->stages[i].error;
+                }
+                if (malformed)
+                {
+                        line->bench_runs = 0;
+                        first->error = 1;
+                }
+                return;
+        }
+        if (line->timed)
+        {
+                if (first->argc == 0 && line->pipelines[0].stage_count == 1 && first->output_count == 0 && first->input_file == NULL)
+                {
+                        line->pipelines++;
+                        line->pipeline_count--;
+                }
+                else if (first->argc == 0)
+                {
+                        first->error = 1;
+                }
+        }
+}
+
+
+////// BUILTINS
+
+// Commands the shell runs itself, looked up by name in builtins[] before the search path is ever touched.
+// A plain builtin command runs right in the shell process, with its > target opened for it: no fork, no exec.
+// As a pipeline stage it runs in a forked child (spawn_command forks and calls it instead of exec'ing), so it
+// still gets its own pipe ends; state changes made there (cd, path, ...) are lost, like in a subshell.
+// Handlers take the NULL terminated argv and the fd to write their output to, and return the exit status.
+
+struct Builtin {
+        const char* name;
+        int (*run)(char **args, int out);
+};
+
+const struct Builtin builtins[] = {
+        {"exit", handle_exit},
+        {"cd", handle_cd},
+        {"path", handle_path},
+        {"hash", handle_hash},
+        {"maxjobs", handle_maxjobs},
+        {"jobs", handle_jobs},
+        {"wait", handle_wait},
+        {"fg", handle_fg},
+        {"echo", handle_echo},
+        {"pwd", handle_pwd},
+        {"true", handle_true},
+        {"false", handle_false},
+        {"test", handle_test},
+        {"[", handle_test},
+        {"printf", handle_printf},
+        {NULL, NULL},
+};
+
+
+// find_builtin - the builtin called name, NULL if it's an external command
+const struct Builtin* find_builtin(const char* name)
+{
+        for (const struct Builtin* builtin = builtins; builtin->name != NULL; builtin++)
+        {
+                if (builtin->name[0] == name[0] && strcmp(builtin->name, name) == 0)
+                {
+                        return builtin;
+                }
+        }
+        return NULL;
+}
+
+
+// run_builtin - runs a builtin command in the shell process, writing to the stage's > target if it has one, else to out
+int run_builtin(const struct Builtin* builtin, struct Stage* stage, int out)
+{
+        if (stage->input_file != NULL && access(stage->input_file, R_OK) == -1)  // No builtin reads stdin, but < still has to work
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        if (stage->output_count > 0)
+        {
+                out = open(stage->output_files[0], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (out == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        return 1;
+                }
+        }
+        int status = builtin->run(stage->argv, out);
+        if (stage->output_count > 0)
+        {
+                close(out);
+        }
+        if (copy_to_other_targets(stage) != 0)                          // "> a > b": b gets a copy of a
+        {
+                status = 1;
+        }
+        return status;
+}
+
+
+// write_all - writes all of data, -1 on error (e.g. EPIPE: the shell ignores SIGPIPE)
+int write_all(int fd, const char* data, size_t length)
+{
+        while (length > 0)
+        {
+                ssize_t written = write(fd, data, length);
+                if (written == -1 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (written <= 0)
+                {
+                        return -1;
+                }
+                data += written;
+                length -= written;
+        }
+        return 0;
+}
+
+
+int handle_cd(char **args, int out)
+{
+        int res = chdir(*(args+1));
+        if (res == -1)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        reopen_relative_search_paths();                 // relative search paths now point somewhere else
+        return 0;
+}
+
+
+int handle_exit(char **args, int out)
+{
+        // since we got rid of any spaces, any existence of non space character must be at the second arg
+        char *second_arg = args[1];
+        if (second_arg != NULL)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+        }
+        if (in_builtin_stage)                                   // Case: "exit | cat" only ends the stage, like a subshell
+        {
+                return 0;
+        }
+
+        free_shell_memory();
+        exit(0);
+}
+
+
+// handle_path - adds path into the global search_paths array
+int handle_path(char **args, int out)
+{
+        int count = 0;
+        int index = 1;
+        free_search_paths();
+        while (args[index] != NULL)
+        {
+                add_path(search_paths, count, args[index]);
+                index++;
+                count++;
+        }
+        // Even if path has no arguments, we clear the search paths
+        search_paths[count] = NULL;                     // Note: empty search_paths[i] starts 0x0
+        clear_command_hash();
+        return 0;
+}
+
+
+// add_path - adds path to current available search_paths global array
+void add_path(char** search_paths, int index, const char* path)
+{
+        search_paths[index] = malloc(strlen(path) + 2);
+        if (search_paths[index] == NULL) {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                exit(1);
+        }
+        strcpy(search_paths[index], path);
+        strcat(search_paths[index], "/");
+        search_path_fds[index] = open(path, DIRECTORY_FD_FLAGS);               // -1 if it doesn't exist, skipped on lookup
+        search_path_mtimes[index] = 0;
+}
+
+
+void free_search_paths()
+{
+        for (int i = 0; search_paths[i] != NULL; i++)
+        {
+                free(search_paths[i]);
+                if (search_path_fds[i] != -1)
+                {
+                        close(search_path_fds[i]);
+                }
+        }
+}
+
+
+void add_bin_path_automatically()
+{
+    add_path(search_paths, 0, "/bin");
+    add_path(search_paths, 1, "/usr/bin");
+    add_path(search_paths, 2, "/sbin");
+    search_paths[3] = NULL;
+}
+
+
+// handle_echo - prints its arguments separated by spaces, `echo -n` without the newline
+int handle_echo(char **args, int out)
+{
+        int first = 1;
+        int newline = 1;
+        if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+        {
+                first = 2;
+                newline = 0;
+        }
+        size_t length = 1;
+        for (int i = first; args[i] != NULL; i++)
+        {
+                length += strlen(args[i]) + 1;
+        }
+        char* text = arena_alloc(line_arena, length);                  // One write for the whole line, gone with the line
+        size_t used = 0;
+        for (int i = first; args[i] != NULL; i++)
+        {
+                if (i > first)
+                {
+                        text[used++] = ' ';
+                }
+                size_t word_length = strlen(args[i]);
+                memcpy(text + used, args[i], word_length);
+                used += word_length;
+        }
+        if (newline)
+        {
+                text[used++] = '\n';
+        }
+        return write_all(out, text, used) == -1 ? 1 : 0;
+}
+
+
+// handle_pwd - prints the working directory
+int handle_pwd(char **args, int out)
+{
+        char* directory = getcwd(NULL, 0);
+        if (directory == NULL)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        size_t length = strlen(directory);
+        directory[length] = '\n';                                       // getcwd sized it to fit, the \0 becomes the \n
+        int failed = write_all(out, directory, length + 1);
+        free(directory);
+        return failed ? 1 : 0;
+}
+
+
+int handle_true(char **args, int out)
+{
+        return 0;
+}
+
+
+int handle_false(char **args, int out)
+{
+        return 1;
+}
+
+
+// handle_test - `test expression` / `[ expression ]`: 0 if true, 1 if false, 2 if it can't be evaluated
+int handle_test(char **args, int out)
+{
+        int count = 0;
+        while (args[count + 1] != NULL)
+        {
+                count++;
+        }
+        if (strcmp(args[0], "[") == 0)
+        {
+                if (count == 0 || strcmp(args[count], "]") != 0)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        return 2;
+                }
+                count--;
+        }
+        int result = evaluate_test(args + 1, count);
+        if (result == 2)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+        }
+        return result;
+}
+
+
+// evaluate_test - the POSIX test forms by argument count: "! expr", "string", "-op operand" and "a -op b"
+int evaluate_test(char **args, int count)
+{
+        if (count == 0)
+        {
+                return 1;
+        }
+        if (strcmp(args[0], "!") == 0 && count <= 4)
+        {
+                int result = evaluate_test(args + 1, count - 1);
+                return result == 2 ? 2 : !result;
+        }
+        if (count == 1)
+        {
+                return args[0][0] != '\0' ? 0 : 1;
+        }
+        if (count == 2)
+        {
+                const char* op = args[0];
+                const char* operand = args[1];
+                struct stat info;
+                if (strcmp(op, "-n") == 0) return operand[0] != '\0' ? 0 : 1;
+                if (strcmp(op, "-z") == 0) return operand[0] == '\0' ? 0 : 1;
+                if (strcmp(op, "-e") == 0) return stat(operand, &info) == 0 ? 0 : 1;
+                if (strcmp(op, "-f") == 0) return stat(operand, &info) == 0 && S_ISREG(info.st_mode) ? 0 : 1;
+                if (strcmp(op, "-d") == 0) return stat(operand, &info) == 0 && S_ISDIR(info.st_mode) ? 0 : 1;
+                if (strcmp(op, "-s") == 0) return stat(operand, &info) == 0 && info.st_size > 0 ? 0 : 1;
+                if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode) ? 0 : 1;
+                if (strcmp(op, "-r") == 0) return access(operand, R_OK) == 0 ? 0 : 1;
+                if (strcmp(op, "-w") == 0) return access(operand, W_OK) == 0 ? 0 : 1;
+                if (strcmp(op, "-x") == 0) return access(operand, X_OK) == 0 ? 0 : 1;
+                return 2;
+        }
+        if (count == 3)
+        {
+                const char* op = args[1];
+                if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(args[0], args[2]) == 0 ? 0 : 1;
+                if (strcmp(op, "!=") == 0) return strcmp(args[0], args[2]) != 0 ? 0 : 1;
+
+                char* end_left;
+                char* end_right;
+                errno = 0;
+                long long left = strtoll(args[0], &end_left, 10);
+                long long right = strtoll(args[2], &end_right, 10);
+                if (end_left == args[0] || *end_left != '\0' || end_right == args[2] || *end_right != '\0' || errno != 0)
+                {
+                        return 2;
+                }
+                if (strcmp(op, "-eq") == 0) return left == right ? 0 : 1;
+                if (strcmp(op, "-ne") == 0) return left != right ? 0 : 1;
+                if (strcmp(op, "-lt") == 0) return left < right ? 0 : 1;
+                if (strcmp(op, "-le") == 0) return left <= right ? 0 : 1;
+                if (strcmp(op, "-gt") == 0) return left > right ? 0 : 1;
+                if (strcmp(op, "-ge") == 0) return left >= right ? 0 : 1;
+                return 2;
+        }
+        return 2;
+}
+
+
+// handle_printf - `printf format [argument ...]`: %s %c %d %i %u %o %x %X %% (with flags, width and precision; %b is
+// taken as %s) and the usual backslash escapes in the format. Like POSIX printf, the format is reused until every argument has been consumed.
+int handle_printf(char **args, int out)
+{
+        if (args[1] == NULL)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 2;
+        }
+        char* text = NULL;
+        size_t length = 0;
+        FILE* stream = open_memstream(&text, &length);                 // Built up in memory, written out in one go
+        if (stream == NULL)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+
+        const char* format = args[1];
+        char** next_arg = &args[2];
+        int status = 0;
+        do
+        {
+                char** pass_start = next_arg;
+                for (const char* p = format; *p != '\0'; p++)
+                {
+                        if (*p == '\\')
+                        {
+                                p++;
+                                switch (*p)
+                                {
+                                case 'n': fputc('\n', stream); break;
+                                case 't': fputc('\t', stream); break;
+                                case 'r': fputc('\r', stream); break;
+                                case 'a': fputc('\a', stream); break;
+                                case 'b': fputc('\b', stream); break;
+                                case 'f': fputc('\f', stream); break;
+                                case 'v': fputc('\v', stream); break;
+                                case '\\': fputc('\\', stream); break;
+                                case '\0': fputc('\\', stream); p--; break;
+                                default:
+                                        if (*p >= '0' && *p <= '7')       // \NNN octal
+                                        {
+                                                int value = 0;
+                                                for (int digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++)
+                                                {
+                                                        value = value * 8 + (*p - '0');
+                                                }
+                                                p--;
+                                                fputc(value, stream);
+                                        }
+                                        else
+                                        {
+                                                fputc('\\', stream);
+                                                fputc(*p, stream);
+                                        }
+                                }
+                                continue;
+                        }
+                        if (*p != '%')
+                        {
+                                fputc(*p, stream);
+                                continue;
+                        }
+                        if (p[1] == '%')
+                        {
+                                fputc('%', stream);
+                                p++;
+                                continue;
+                        }
+
+                        // Copy "%[flags][width][.precision]" into spec, then add the length modifier and conversion
+                        char spec[32];
+                        size_t spec_length = 0;
+                        spec[spec_length++] = *p++;
+                        while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && spec_length < sizeof(spec) - 4)
+                        {
+                                spec[spec_length++] = *p++;
+                        }
+                        char conversion = *p;
+                        const char* argument = *next_arg != NULL ? *next_arg++ : NULL;
+                        if (conversion == 's' || conversion == 'b' || conversion == 'c')
+                        {
+                                const char* string = argument != NULL ? argument : "";
+                                char character[2] = {string[0], '\0'};
+                                spec[spec_length++] = 's';
+                                spec[spec_length] = '\0';
+                                fprintf(stream, spec, conversion == 'c' ? character : string);
+                        }
+                        else if (conversion != '\0' && strchr("diouxX", conversion) != NULL)
+                        {
+                                char* end = NULL;
+                                errno = 0;
+                                long long value = argument == NULL ? 0 : strtoll(argument, &end, 0);
+                                if (argument != NULL && (end == argument || *end != '\0' || errno != 0))
+                                {
+                                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                        status = 1;
+                                }
+                                spec[spec_length++] = 'l';
+                                spec[spec_length++] = 'l';
+                                spec[spec_length++] = conversion;
+                                spec[spec_length] = '\0';
+                                fprintf(stream, spec, value);
+                        }
+                        else                                            // Case: unknown conversion or a lone % at the end
+                        {
+                                spec[spec_length] = '\0';
+                                fputs(spec, stream);
+                                if (conversion == '\0')
+                                {
+                                        break;
+                                }
+                                fputc(conversion, stream);
+                        }
+                }
+                if (next_arg == pass_start)                             // The format took no arguments, don't loop forever
+                {
+                        break;
+                }
+        } while (*next_arg != NULL);
+
+        fclose(stream);
+        if (write_all(out, text, length) == -1)
+        {
+                status = 1;
+        }
+        free(text);
+        return status;
+}
+
+
+////// COMMAND HASH
+
+// Resolved command cache (like bash's `hash`), keyed by command name.
+// Lookups go through the directory fds opened by `path`: a hit costs one fstat per search path, a miss one faccessat per search path on top.
+// The cache is dropped when `path` runs, when `cd` moves relative search paths, and when a search path directory's mtime moves.
+struct HashEntry {
+        char* name;                     // command name (key)
+        int path_index;                 // index into search_paths / search_path_fds
+        char* full_path;                // search path + name, for execv fallback and `hash` output
+        unsigned long hits;             // times served from the cache
+        struct HashEntry* next;         // bucket chain
+};
+
+struct HashEntry* command_hash[COMMAND_HASH_BUCKETS];
+unsigned long hash_hits = 0;
+unsigned long hash_misses = 0;
+
+
+unsigned int hash_command_name(const char* name)
+{
+        unsigned int hash = 5381;
+        while (*name)
+        {
+                hash = hash * 33 + (unsigned char) *name++;
+        }
+        return hash % COMMAND_HASH_BUCKETS;
+}
+
+
+// lookup_command - finds name in the search paths, through the cache. Returns NULL if it isn't executable anywhere.
+// E.g. "/bin/" works with name="ls". Absolute names aren't looked up: faccessat would ignore the directory fd for them.
+struct HashEntry* lookup_command(const char* name)
+{
+        if (name[0] == '/')
+        {
+                return NULL;
+        }
+        check_search_paths();
+
+        unsigned int bucket = hash_command_name(name);
+        for (struct HashEntry* entry = command_hash[bucket]; entry != NULL; entry = entry->next)
+        {
+                if (strcmp(entry->name, name) == 0)
+                {
+                        entry->hits++;
+                        hash_hits++;
+                        return entry;
+                }
+        }
+
+        hash_misses++;
+        for (int count = 0; search_paths[count] != NULL; count++)
+        {
+                if (search_path_fds[count] == -1)
+                {
+                        continue;
+                }
+                count_metric(METRIC_PATH_PROBES, 1);
+                if (faccessat(search_path_fds[count], name, X_OK, 0) != 0)
+                {
+                        continue;
+                }
+                struct HashEntry* entry = malloc(sizeof(struct HashEntry));
+                if (entry == NULL)
+                {
+                        return NULL;
+                }
+                entry->name = strdup(name);
+                entry->path_index = count;
+                entry->full_path = malloc(strlen(search_paths[count]) + strlen(name) + 1);
+                strcpy(entry->full_path, search_paths[count]);
+                strcat(entry->full_path, name);
+                entry->hits = 0;
+                entry->next = command_hash[bucket];
+                command_hash[bucket] = entry;
+                return entry;
+        }
+        return NULL;
+}
+
+
+// exec_command - execs a resolved command in the current (child) process. Only returns on failure.
+// Uses execveat relative to the search path's directory fd, so the directory isn't walked again.
+void exec_command(struct HashEntry* entry, char** args)
+{
+        if (entry == NULL)
+        {
+                return;
+        }
+#if defined(__linux__) && defined(SYS_execveat)
+        extern char **environ;
+        int dir_fd = search_path_fds[entry->path_index];
+        syscall(SYS_execveat, dir_fd, entry->name, args, environ, 0);
+        // #! scripts are handed to their interpreter as /dev/fd/<dir_fd>/name, which a close-on-exec dir_fd can't be
+        // (execveat says ENOENT). Only for those is the fd kept across the exec: children get just the fds they need.
+        if (errno == ENOENT)
+        {
+                fcntl(dir_fd, F_SETFD, 0);
+                syscall(SYS_execveat, dir_fd, entry->name, args, environ, 0);
+        }
+#endif
+        execv(entry->full_path, args);
+}
+
+
+void clear_command_hash()
+{
+        for (int i = 0; i < COMMAND_HASH_BUCKETS; i++)
+        {
+                struct HashEntry* entry = command_hash[i];
+                while (entry != NULL)
+                {
+                        struct HashEntry* next = entry->next;
+                        free(entry->name);
+                        free(entry->full_path);
+                        free(entry);
+                        entry = next;
+                }
+                command_hash[i] = NULL;
+        }
+}
+
+
+// check_search_paths - drops the cache if an entry was created, deleted or renamed in a search path directory since the last lookup.
+// A change in the same second as the last look leaves the mtime alone, so an mtime that recent isn't trusted: it's looked at again next time.
+void check_search_paths()
+{
+        time_t now = time(NULL);
+        int changed = 0;
+        for (int i = 0; search_paths[i] != NULL; i++)
+        {
+                struct stat status;
+                if (search_path_fds[i] == -1 || fstat(search_path_fds[i], &status) != 0)
+                {
+                        continue;
+                }
+                if (status.st_mtime != search_path_mtimes[i])
+                {
+                        changed = 1;
+                }
+                search_path_mtimes[i] = now - status.st_mtime > 1 ? status.st_mtime : 0;
+        }
+        if (changed)
+        {
+                clear_command_hash();
+        }
+}
+
+
+// reopen_relative_search_paths - after cd, relative search paths resolve against the new working directory
+void reopen_relative_search_paths()
+{
+        int relative = 0;
+        for (int i = 0; search_paths[i] != NULL; i++)
+        {
+                if (search_paths[i][0] == '/')
+                {
+                        continue;
+                }
+                relative = 1;
+                if (search_path_fds[i] != -1)
+                {
+                        close(search_path_fds[i]);
+                }
+                search_path_fds[i] = open(search_paths[i], DIRECTORY_FD_FLAGS);
+                search_path_mtimes[i] = 0;
+        }
+        if (relative)
+        {
+                clear_command_hash();
+        }
+}
+
+
+// handle_hash - prints the cache with per-command hits, and overall hits/misses. `hash -r` forgets everything.
+int handle_hash(char **args, int out)
+{
+        if (args[1] != NULL)
+        {
+                if (strcmp(args[1], "-r") != 0 || args[2] != NULL)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        return 1;
+                }
+                clear_command_hash();
+                hash_hits = 0;
+                hash_misses = 0;
+                return 0;
+        }
+
+        check_search_paths();
+        dprintf(out, "hits\tcommand\n");
+        for (int i = 0; i < COMMAND_HASH_BUCKETS; i++)
+        {
+                for (struct HashEntry* entry = command_hash[i]; entry != NULL; entry = entry->next)
+                {
+                        dprintf(out, "%4lu\t%s\n", entry->hits, entry->full_path);
+                }
+        }
+        dprintf(out, "lookups: %lu hits, %lu misses\n", hash_hits, hash_misses);
+        return 0;
+}
+
+
+////// SPAWN LAYER
+
+// Every external command is started through spawn_command, with one of these backends:
+//   fork         fork, then redirect and exec in the child
+//   vfork        same, but the child borrows the shell's memory until it execs
+//   posix_spawn  redirections become posix_spawn file actions (default)
+//   clone        clone(CLONE_VM | CLONE_VFORK) onto a small private stack (Linux)
+// Picked with QISH_SPAWN=<backend> or -s <backend>.
+// select_spawn_backend - sets the backend by name, -1 if there is no such backend (on this platform)
+int select_spawn_backend(const char* name)
+{
+        for (int i = 0; spawn_backend_names[i] != NULL; i++)
+        {
+                if (strcmp(spawn_backend_names[i], name) == 0)
+                {
+#ifndef __linux__
+                        if (i == SPAWN_BACKEND_CLONE)
+                        {
+                                return -1;
+                        }
+#endif
+                        spawn_backend = i;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+
+// add_spawn_action - appends to the request's actions (in line_arena, they only live as long as the line)
+void add_spawn_action(struct SpawnRequest* request, int type, int fd, int target, const char* path)
+{
+        grow_array((void**) &request->actions, &request->action_capacity, request->action_count, sizeof(struct SpawnAction));
+        request->actions[request->action_count++] = (struct SpawnAction){type, fd, target, path};
+}
+
+
+// spawn_child - runs in the new process for the fork / vfork / clone backends. Never returns.
+// With vfork and clone the shell's memory is shared until exec, so no malloc, stdio or locks in here: only syscall
+// wrappers, signal() to reset SIGPIPE, and count_metric, a lock-free atomic add to the shared metrics page.
+int spawn_child(void* argument)
+{
+        struct SpawnRequest* request = argument;
+        setpgid(0, request->process_group);                             // Its job's group (see JOB CONTROL)
+        reset_child_signals();                                          // The shell blocks SIGCHLD and SIGINT for its reaper
+        signal(SIGPIPE, SIG_DFL);                                       // and ignores SIGPIPE
+        for (int i = 0; i < request->action_count; i++)
+        {
+                struct SpawnAction action = request->actions[i];
+                if (action.type == SPAWN_DUP2 && action.fd != action.target)
+                {
+                        dup2(action.fd, action.target);
+                }
+                else if (action.type == SPAWN_DUP2)                     // Already in place (e.g. stdin was closed): keep it across exec
+                {
+                        fcntl(action.fd, F_SETFD, 0);
+                }
+                else if (action.type == SPAWN_CLOSE)
+                {
+                        close(action.fd);
+                }
+                else if (action.type == SPAWN_OPEN || action.type == SPAWN_OPEN_INPUT)
+                {
+                        int fd = action.type == SPAWN_OPEN ? open(action.path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(action.path, O_RDONLY);
+                        if (fd == -1)
+                        {
+                                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                _exit(1);
+                        }
+                        dup2(fd, action.target);
+                        close(fd);
+                }
+        }
+        if (request->builtin != NULL)                                   // Builtin pipeline stage: run it here instead of exec'ing
+        {
+                in_builtin_stage = 1;
+                close_filter_fds();
+                _exit(request->builtin->run(request->args, STDOUT_FILENO));
+        }
+        exec_command(request->command, request->args);
+
+        // if exec failed
+        count_metric(METRIC_EXEC_FAILED, 1);
+        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+        _exit(1);                                                       // _exit: leave the batch file offset alone
+}
+
+
+// spawn_posix - posix_spawn backend, the actions become file actions.
+// posix_spawn only takes a path, so this backend execs full_path: execveat through the search path fd is fork / vfork / clone only.
+pid_t spawn_posix(struct SpawnRequest* request)
+{
+        extern char **environ;
+        posix_spawn_file_actions_t file_actions;
+        posix_spawn_file_actions_init(&file_actions);
+        for (int i = 0; i < request->action_count; i++)
+        {
+                struct SpawnAction action = request->actions[i];
+                if (action.type == SPAWN_DUP2)
+                {
+                        posix_spawn_file_actions_adddup2(&file_actions, action.fd, action.target);
+                }
+                else if (action.type == SPAWN_CLOSE)
+                {
+                        posix_spawn_file_actions_addclose(&file_actions, action.fd);
+                }
+                else if (action.type == SPAWN_OPEN)
+                {
+                        posix_spawn_file_actions_addopen(&file_actions, action.target, action.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                }
+                else if (action.type == SPAWN_OPEN_INPUT)
+                {
+                        posix_spawn_file_actions_addopen(&file_actions, action.target, action.path, O_RDONLY, 0);
+                }
+        }
+
+        posix_spawnattr_t attributes;                                   // The shell blocks SIGCHLD for its reaper, the child shouldn't
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigmask(&attributes, &original_signal_mask);
+        sigset_t default_signals;                                       // and ignores SIGPIPE
+        sigemptyset(&default_signals);
+        sigaddset(&default_signals, SIGPIPE);
+        if (terminal_fd != -1)                                          // and SIGTTOU, when it hands the terminal around
+        {
+                sigaddset(&default_signals, SIGTTOU);
+        }
+        posix_spawnattr_setsigdefault(&attributes, &default_signals);
+        posix_spawnattr_setpgroup(&attributes, request->process_group);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+        pid_t pid;
+        int res = posix_spawn(&pid, request->command->full_path, &file_actions, &attributes, request->args, environ);
+        posix_spawn_file_actions_destroy(&file_actions);
+        posix_spawnattr_destroy(&attributes);
+        if (res != 0)
+        {
+                count_metric(METRIC_EXEC_FAILED, 1);
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return -1;
+        }
+        return pid;
+}
+
+
+// spawn_vfork - vfork backend. Its own function so that none of spawn_command's locals live across the vfork,
+// where the child's writes to the shared stack could clobber them.
+pid_t spawn_vfork(struct SpawnRequest* request)
+{
+        pid_t pid = vfork();
+        if (pid == 0)
+        {
+                spawn_child(request);
+        }
+        return pid;
+}
+
+
+// spawn_command - starts request->command in a new process with the requested backend. Returns its pid, or -1.
+// The command must already be resolved (request->command != NULL), or be a builtin: those always fork, since the
+// child runs shell code rather than exec'ing right away.
+pid_t spawn_command(struct SpawnRequest* request)
+{
+        pid_t pid = -1;
+        double spawning = trace_now();
+        double spawn_started = metrics != NULL ? metrics_now() : 0;
+        int backend = request->builtin != NULL ? SPAWN_BACKEND_FORK : spawn_backend;
+        switch (backend)
+        {
+        case SPAWN_BACKEND_POSIX_SPAWN:
+                pid = spawn_posix(request);
+                break;
+        case SPAWN_BACKEND_FORK:
+                pid = fork();
+                if (pid == 0)
+                {
+                        spawn_child(request);
+                }
+                break;
+        case SPAWN_BACKEND_VFORK:
+                pid = spawn_vfork(request);
+                break;
+        case SPAWN_BACKEND_CLONE:
+#ifdef __linux__
+        {
+                // CLONE_VFORK: the shell is suspended until the child execs, so the stack can be freed right after
+                char* stack = malloc(CLONE_STACK_SIZE);
+                if (stack == NULL)
+                {
+                        break;
+                }
+                pid = clone(spawn_child, stack + CLONE_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, request);
+                free(stack);
+        }
+#endif
+                break;
+        }
+        if (pid < 0 && backend != SPAWN_BACKEND_POSIX_SPAWN)            // spawn_posix reports its own errors
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+        }
+        trace_spawn(pid, request->args[0], spawning);
+        if (pid > 0 && metrics != NULL)
+        {
+                count_metric(request->builtin != NULL ? METRIC_FORKS_BUILTIN : METRIC_FORKS_COMMAND, 1);
+                observe_metric(METRIC_SPAWN_SECONDS, metrics_now() - spawn_started);
+        }
+        return pid;
+}
+
+
+// a struct that represents a command
+struct Command {
+        char** command;                 // Command array
+        int need_redirection;           // If there is a file redirection in here
+        int personal_pipe[2];           // Personal pipe for holding redirection
+        char** file_names;              // files to redirect to
+        int file_count;
+        int pipe_to_read_from;          // pipe to read from
+        int pipe_to_write_to;           // pipe to write to
+};
+
+
+// The pipe ends the shell holds while it starts a pipeline. Pipes are made right before the stage that writes
+// them, and each end is closed as soon as the process that needs it is running, so there are only ever a few of
+// them (plus a read end per consumer of a |+), however long the pipeline is.
+struct PipelineFds {
+        int* fds;
+        int count;
+        int capacity;
+};
+
+
+// execute_piped_command - starts a parsed pipeline e.g. {"ls"} | {"wc" > output.txt} | {"wc"}, its last stage writing to output
+// This should be used when a & group has a | operator in it.
+// After a |+, the consumers each get their own pipe, which a broadcast helper fills from the producer's output.
+// Every stage and tee helper is added to job and left running, reap_children collects them with the line's other jobs.
+// With -t, stages that parse_filter recognises run as threads of the shell instead (see THREADED FILTERS).
+void execute_piped_command(struct Pipeline *pipeline, struct Job *job, int output)
+{
+        int pipe_count = pipeline->stage_count - 1;
+        int consumer_count = pipeline->consumer_count;
+        int producer = pipe_count - consumer_count;                     // |+: the stage every consumer reads
+
+        // Most fds open at once: a stage's input, the pipe after it, its personal pipe, a |+'s pipes, one stage's > files
+        int most_files = 0;
+        for (int i = 0; i < pipe_count+1; i++)
+        {
+                most_files = pipeline->stages[i].output_count > most_files ? pipeline->stages[i].output_count : most_files;
+        }
+        int needed = 5 + 3 * consumer_count + most_files;
+        int spare = fd_headroom(needed + (thread_filters ? 2 * (pipe_count+1) : 0));
+        if (spare < needed)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return;
+        }
+        int filter_fds = spare - needed;                                // What filter threads may keep open (2 each)
+
+        struct PipelineFds held = {0};
+        int input = STDIN_FILENO;                                       // Read end for the next stage
+        int* consumer_inputs = NULL;                                    // |+: each consumer's read end
+
+        // Calling now
+        // Every stage (and every tee helper) is started before any of them is waited on,
+        // otherwise a stage that writes more than the pipe buffer blocks forever on a reader that hasn't started.
+        for (int i = 0; i < pipe_count+1; i++)
+        {
+                struct Stage *stage = &pipeline->stages[i];
+                int role = (i == pipe_count ? PROCESS_LAST_STAGE : 0) | (i > producer || i == pipe_count ? PROCESS_SINK : 0);
+                struct Command current_command = {stage->argv, stage->output_count > 0, {-1, -1}, stage->output_files, stage->output_count, input, output};
+                if (i > producer)                                       // |+ consumer: its own pipe out of the broadcast helper
+                {
+                        current_command.pipe_to_read_from = consumer_inputs[i - producer - 1];
+                }
+
+                int next_pipe[2] = {-1, -1};
+                if (i < producer || (i == producer && consumer_count > 0))
+                {
+                        if (open_pipeline_pipe(&held, next_pipe) == -1)
+                        {
+                                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                break;
+                        }
+                        current_command.pipe_to_write_to = next_pipe[1];        // Each command writes to its pipe, except for the last ones
+                }
+
+                // Stages with their own > get a personal pipe, which a tee helper copies into both the file and the next pipe
+                if (current_command.need_redirection && open_pipeline_pipe(&held, current_command.personal_pipe) == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        break;
+                }
+                int stage_output = current_command.need_redirection ? current_command.personal_pipe[1] : current_command.pipe_to_write_to;
+
+#ifdef F_SETPIPE_SZ
+                // Bigger personal pipe -> fewer tee/splice round trips (best effort)
+                if (current_command.need_redirection)
+                {
+                        fcntl(current_command.personal_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+                }
+#endif
+
+                // Simple filters can run as a thread instead (-t), reading and writing the same fds
+                int reads_file = stage->input_file != NULL;
+                struct Filter* filter = thread_filters && reaper_epoll_fd != -1 && !reads_file && filter_fds >= 2 ? parse_filter(current_command.command) : NULL;
+                int threaded = filter != NULL && start_filter(filter, job - jobs, role, current_command.pipe_to_read_from, stage_output) == 0;
+                if (filter != NULL && !threaded)
+                {
+                        free_filter(filter);
+                }
+                if (threaded)
+                {
+                        filter_fds -= 2;
+                        time_filter(filter, job->output_group, i, stage->argv);
+                }
+
+                pid_t child = -1;
+                if (!threaded)
+                {
+                        struct SpawnRequest request = {0};
+                        request.builtin = find_builtin(current_command.command[0]);
+                        double looking_up = trace_now();
+                        request.command = request.builtin ? NULL : lookup_command(current_command.command[0]);
+                        trace_span("lookup", "lookup", looking_up);
+                        request.args = current_command.command;
+                        request.process_group = job->pgid;
+                        add_spawn_action(&request, SPAWN_DUP2, current_command.pipe_to_read_from, STDIN_FILENO, NULL);
+                        add_spawn_action(&request, SPAWN_DUP2, stage_output, STDOUT_FILENO, NULL);
+                        if (reads_file)                                 // < replaces the pipe from the previous stage
+                        {
+                                add_spawn_action(&request, SPAWN_OPEN_INPUT, -1, STDIN_FILENO, stage->input_file);
+                        }
+                        if (request.builtin != NULL)                    // exec'd stages lose the rest through O_CLOEXEC
+                        {
+                                add_pipeline_close_actions(&request, &held);
+                        }
+
+                        if (request.command == NULL && request.builtin == NULL)
+                        {
+                                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                count_metric(METRIC_NOT_FOUND, 1);
+                        }
+                        else
+                        {
+                                child = spawn_command(&request);
+                        }
+                        if (child > 0)
+                        {
+                                time_process(child, job->output_group, i, time_label(stage->argv, request.builtin ? " (builtin)" : ""));
+                        }
+                }
+                if (child > 0)
+                {
+                        add_job_process(job, child, role);
+                }
+
+                if (current_command.need_redirection)
+                {
+                        // Tee helper: copies the stage's personal pipe into all of its files and the next pipe
+                        // (a plain command with several > targets is a one stage pipeline, only its files get the output)
+                        int* file_fds = arena_alloc(line_arena, current_command.file_count * sizeof(int));
+                        int file_count = 0;
+                        for (int j = 0; j < current_command.file_count; j++)
+                        {
+                                int file_fd = open(current_command.file_names[j], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                                if (file_fd == -1)
+                                {
+                                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                        continue;
+                                }
+                                file_fds[file_count++] = file_fd;
+                        }
+
+                        double forking = trace_now();
+                        pid_t helper = fork();
+                        if (helper < 0)
+                        {
+                                fprintf(stderr, "FORK FAILED");
+                        }
+                        else if (helper == 0)
+                        {
+                                setpgid(0, job->pgid);
+                                reset_child_signals();
+                                signal(SIGPIPE, SIG_DFL);               // Stop copying once the reader is gone
+                                int source = dup(current_command.personal_pipe[0]);
+                                int next = pipe_count > 0 ? dup(current_command.pipe_to_write_to) : -1;
+                                close_pipeline_fds(&held);
+                                close_filter_fds();
+
+                                copy_stage_output(source, file_fds, file_count, next);
+                                _exit(0);                                       // _exit: don't flush the shell's stdin buffer, which would rewind the batch file
+                        }
+                        else
+                        {
+                                trace_spawn(helper, "tee helper", forking);
+                                count_metric(METRIC_FORKS_HELPER, 1);
+                                add_job_process(job, helper, role & PROCESS_SINK);    // A sink's output isn't all out before its helper is done
+                                time_process(helper, job->output_group, i, "(tee helper)");
+                        }
+                        for (int j = 0; j < file_count; j++)
+                        {
+                                close(file_fds[j]);
+                        }
+                        release_pipeline_fd(&held, current_command.personal_pipe[0]);
+                        release_pipeline_fd(&held, current_command.personal_pipe[1]);
+                }
+
+                // The stage (and its helper) have their ends now, the shell only keeps the read end for the next one
+                release_pipeline_fd(&held, current_command.pipe_to_read_from);
+                release_pipeline_fd(&held, next_pipe[1]);
+                input = next_pipe[0];
+
+                // Broadcast helper: copies the producer's output into every consumer's pipe.
+                // Started before the consumers, so they can be given just their read ends.
+                if (i == producer && consumer_count > 0)
+                {
+                        consumer_inputs = arena_alloc(line_arena, consumer_count * sizeof(int));
+                        int* consumer_fds = arena_alloc(line_arena, consumer_count * sizeof(int));
+                        int made = 0;
+                        for (; made < consumer_count; made++)
+                        {
+                                int consumer_pipe[2];
+                                if (open_pipeline_pipe(&held, consumer_pipe) == -1)
+                                {
+                                        break;
+                                }
+#ifdef F_SETPIPE_SZ
+                                fcntl(consumer_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);    // Broadcast pipes: a whole chunk fits in each
+#endif
+                                consumer_inputs[made] = consumer_pipe[0];
+                                consumer_fds[made] = consumer_pipe[1];
+                        }
+                        if (made < consumer_count)
+                        {
+                                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                                break;
+                        }
+
+                        double forking = trace_now();
+                        pid_t helper = fork();
+                        if (helper < 0)
+                        {
+                                fprintf(stderr, "FORK FAILED");
+                        }
+                        else if (helper == 0)
+                        {
+                                setpgid(0, job->pgid);
+                                reset_child_signals();
+                                int source = dup(input);
+                                for (int j = 0; j < consumer_count; j++)
+                                {
+                                        consumer_fds[j] = dup(consumer_fds[j]);
+                                }
+                                close_pipeline_fds(&held);
+                                close_filter_fds();
+
+                                broadcast_output(source, consumer_fds, consumer_count);
+                                _exit(0);
+                        }
+                        else
+                        {
+                                trace_spawn(helper, "broadcast helper", forking);
+                                count_metric(METRIC_FORKS_HELPER, 1);
+                                add_job_process(job, helper, PROCESS_HELPER);
+                                time_process(helper, job->output_group, i, "(broadcast helper)");
+                        }
+                        release_pipeline_fd(&held, input);
+                        for (int j = 0; j < consumer_count; j++)
+                        {
+                                release_pipeline_fd(&held, consumer_fds[j]);
+                        }
+                }
+        }
+
+        // The shell keeps no pipe ends open, so each reader sees EOF once its writers exit
+        // (after an error, the stages already running just see EOF early)
+        close_pipeline_fds(&held);
+        held.count = 0;
+}
+
+
+// open_pipeline_pipe - makes a close-on-exec pipe and adds both ends to held. 0, or -1 if it can't.
+int open_pipeline_pipe(struct PipelineFds* held, int ends[2])
+{
+#ifdef __linux__
+        if (pipe2(ends, O_CLOEXEC) < 0)
+        {
+                return -1;
+        }
+#else
+        if (pipe(ends) < 0)
+        {
+                return -1;
+        }
+        fcntl(ends[0], F_SETFD, FD_CLOEXEC);
+        fcntl(ends[1], F_SETFD, FD_CLOEXEC);
+#endif
+        for (int i = 0; i < 2; i++)
+        {
+                grow_array((void**) &held->fds, &held->capacity, held->count, sizeof(int));
+                held->fds[held->count++] = ends[i];
+        }
+        return 0;
+}
+
+
+// release_pipeline_fd - closes fd if it is one of held's (the shell's stdin and the output aren't), and forgets it
+void release_pipeline_fd(struct PipelineFds* held, int fd)
+{
+        for (int i = 0; i < held->count; i++)
+        {
+                if (held->fds[i] == fd)
+                {
+                        close(fd);
+                        held->fds[i] = held->fds[--held->count];
+                        return;
+                }
+        }
+}
+
+
+// close_pipeline_fds - closes every pipe end the shell holds for the pipeline being started
+// Used by the forked helpers before they start copying, and by the shell once every stage is running.
+void close_pipeline_fds(struct PipelineFds* held)
+{
+        for (int i = 0; i < held->count; i++)
+        {
+                close(held->fds[i]);
+        }
+}
+
+
+// add_pipeline_close_actions - same fds as close_pipeline_fds, as spawn actions for a stage
+void add_pipeline_close_actions(struct SpawnRequest *request, struct PipelineFds* held)
+{
+        for (int i = 0; i < held->count; i++)
+        {
+                add_spawn_action(request, SPAWN_CLOSE, held->fds[i], -1, NULL);
+        }
+}
+
+
+// fd_headroom - how many more fds the shell can open, raising its soft RLIMIT_NOFILE towards the hard one
+// when fewer than wanted are left (children inherit the raised limit).
+// Small asks aren't counted (that takes a readdir): a pipe that can't be made is reported like any other error.
+int fd_headroom(int wanted)
+{
+        if (wanted <= FD_CHECK_THRESHOLD)
+        {
+                return INT_MAX;
+        }
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        {
+                return INT_MAX;
+        }
+        long open_fds = count_open_fds();
+        if (open_fds + wanted > (long) limit.rlim_cur && limit.rlim_cur < limit.rlim_max)
+        {
+                rlim_t raised = open_fds + wanted;
+                limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && raised > limit.rlim_max ? limit.rlim_max : raised;
+                setrlimit(RLIMIT_NOFILE, &limit);
+                getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        long headroom = (long) limit.rlim_cur - open_fds;
+        return headroom > INT_MAX ? INT_MAX : headroom;
+}
+
+
+// count_open_fds - fds the shell has open right now (/proc/self/fd on Linux, otherwise probed one by one)
+long count_open_fds()
+{
+        long count = 0;
+#ifdef __linux__
+        DIR* directory = opendir("/proc/self/fd");
+        if (directory != NULL)
+        {
+                while (readdir(directory) != NULL)
+                {
+                        count++;
+                }
+                closedir(directory);
+                return count - 3;                                       // . .. and the directory's own fd
+        }
+#endif
+        long highest = sysconf(_SC_OPEN_MAX);
+        for (long fd = 0; fd < highest && fd < 65536; fd++)
+        {
+                count += fcntl(fd, F_GETFD) != -1;
+        }
+        return count;
+}
+
+
+// copy_stage_output - fans the output of a redirected pipeline stage out to its files and to the next pipe (-1 if none)
+// On Linux the data never enters user space when there is one file: tee(2) duplicates what is sitting in the source
+// pipe into the next pipe, then splice(2) moves the same bytes from the source pipe into the file. With several
+// files, the duplicated bytes are read once into one buffer, which is written to every file.
+// Falls back to a read/write loop when next isn't a pipe (e.g. the terminal), and to read/write per chunk when the file can't be spliced into.
+void copy_stage_output(int source, int* files, int file_count, int next)
+{
+#ifdef __linux__
+        static char fan_out_buffer[SPLICE_CHUNK];                       // Only touched in the helper process
+        int file_spliceable = (file_count == 1);
+        while (1)
+        {
+                ssize_t duplicated = SPLICE_CHUNK;                      // Nothing to tee into: the files take whatever is there
+                if (next != -1)
+                {
+                        duplicated = tee(source, next, SPLICE_CHUNK, 0);
+                }
+                if (duplicated == 0)                                    // Case: stage closed its output and the pipe is drained
+                {
+                        return;
+                }
+                if (duplicated < 0)
+                {
+                        if (errno == EINTR)
+                        {
+                                continue;
+                        }
+                        break;                                          // Case: next isn't a pipe, nothing consumed yet
+                }
+
+                // Consume exactly the duplicated bytes out of the source pipe
+                while (duplicated > 0)
+                {
+                        ssize_t moved = -1;
+                        if (file_spliceable)
+                        {
+                                moved = splice(source, NULL, files[0], NULL, duplicated, SPLICE_F_MOVE);
+                                if (moved < 0 && errno == EINVAL)
+                                {
+                                        file_spliceable = 0;
+                                }
+                        }
+                        if (moved < 0)
+                        {
+                                size_t want = duplicated < SPLICE_CHUNK ? (size_t) duplicated : SPLICE_CHUNK;
+                                moved = read(source, fan_out_buffer, want);
+                                for (int i = 0; i < file_count && moved > 0; i++)
+                                {
+                                        write_all(files[i], fan_out_buffer, moved);
+                                }
+                        }
+                        if (moved <= 0)                                 // Case: EOF (only without next) or a read error
+                        {
+                                return;
+                        }
+                        count_metric(METRIC_TEE_BYTES, moved);
+                        duplicated -= moved;
+                        if (next == -1)
+                        {
+                                break;
+                        }
+                }
+        }
+#endif
+        copy_stage_output_buffered(source, files, file_count, next);
+}
+
+
+// copy_stage_output_buffered - portable fan out through one user-space buffer
+void copy_stage_output_buffered(int source, int* files, int file_count, int next)
+{
+        char buffer[MAX_REDIRECTED_OUTPUT];
+        ssize_t bytes_read;
+        while ((bytes_read = read(source, buffer, sizeof(buffer))) > 0)
+        {
+                count_metric(METRIC_TEE_BYTES, bytes_read);
+                for (int i = 0; i < file_count; i++)
+                {
+                        write_all(files[i], buffer, bytes_read);
+                }
+                if (next != -1)
+                {
+                        write(next, buffer, bytes_read);
+                }
+        }
+}
+
+
+// broadcast_output - copies source into every consumer pipe (|+), until EOF or until every consumer is gone.
+// On Linux each chunk is tee(2)'d into every consumer, so no consumer's data goes through user space, and then
+// dropped from the source by splicing it into /dev/null. tee blocks while a consumer's pipe is full, so the slowest
+// consumer paces the producer and at most a pipe's worth is ever queued per consumer. A consumer that had room
+// for only part of the chunk gets the rest written from one buffer. A consumer that exits drops out (EPIPE: SIGPIPE
+// is ignored here), the others keep going.
+void broadcast_output(int source, int* consumers, int consumer_count)
+{
+        static char buffer[SPLICE_CHUNK];                               // Only touched in the helper process
+        int live = consumer_count;
+#ifdef __linux__
+        int discard = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        ssize_t teed[consumer_count];
+        while (live > 0)
+        {
+                // The first live consumer decides how big the chunk is, everyone else gets the same bytes
+                ssize_t length = -1;
+                int first = 0;
+                while (consumers[first] == -1)
+                {
+                        first++;
+                }
+                while ((length = tee(source, consumers[first], SPLICE_CHUNK, 0)) == -1 && errno == EINTR)
+                {
+                }
+                if (length == 0)                                        // Case: producer closed its output and the pipe is drained
+                {
+                        return;
+                }
+                if (length < 0 && errno == EPIPE)
+                {
+                        close(consumers[first]);
+                        consumers[first] = -1;
+                        live--;
+                        continue;
+                }
+                if (length < 0)
+                {
+                        break;
+                }
+                count_metric(METRIC_BROADCAST_BYTES, length);
+
+                int all_teed = 1;
+                for (int i = first; i < consumer_count; i++)
+                {
+                        teed[i] = length;
+                        if (i == first || consumers[i] == -1)
+                        {
+                                continue;
+                        }
+                        while ((teed[i] = tee(source, consumers[i], length, 0)) == -1 && errno == EINTR)
+                        {
+                        }
+                        if (teed[i] < 0 && errno == EPIPE)              // Case: consumer is gone, it needs nothing more
+                        {
+                                close(consumers[i]);
+                                consumers[i] = -1;
+                                live--;
+                                teed[i] = length;
+                        }
+                        teed[i] = teed[i] < 0 ? 0 : teed[i];
+                        all_teed &= (teed[i] == length);
+                }
+
+                // Take the chunk out of the source: straight into /dev/null, or into the buffer if someone still needs part of it
+                ssize_t removed = 0;
+                while (all_teed && discard != -1 && removed < length)
+                {
+                        ssize_t moved = splice(source, NULL, discard, NULL, length - removed, SPLICE_F_MOVE);
+                        if (moved <= 0)
+                        {
+                                all_teed = 0;
+                                break;
+                        }
+                        removed += moved;
+                }
+                ssize_t buffered = removed;
+                while (buffered < length)
+                {
+                        ssize_t bytes_read = read(source, buffer + buffered, length - buffered);
+                        if (bytes_read <= 0)
+                        {
+                                return;
+                        }
+                        buffered += bytes_read;
+                }
+                for (int i = first; i < consumer_count && removed < length; i++)
+                {
+                        if (consumers[i] != -1 && teed[i] < length && write_all(consumers[i], buffer + teed[i], length - teed[i]) == -1)
+                        {
+                                close(consumers[i]);
+                                consumers[i] = -1;
+                                live--;
+                        }
+                }
+        }
+#endif
+        // Portable: one read, written to every consumer
+        ssize_t bytes_read;
+        while (live > 0 && (bytes_read = read(source, buffer, sizeof(buffer))) > 0)
+        {
+                count_metric(METRIC_BROADCAST_BYTES, bytes_read);
+                for (int i = 0; i < consumer_count; i++)
+                {
+                        if (consumers[i] != -1 && write_all(consumers[i], buffer, bytes_read) == -1)
+                        {
+                                close(consumers[i]);
+                                consumers[i] = -1;
+                                live--;
+                        }
+                }
+        }
+}
+
+
+////// COPY FAST PATH
+
+// `cat f1 f2 > out` and `cat < in > out` only move bytes from files into a file, so the shell does it itself
+// instead of forking cat and pushing every byte through cat's buffer. Per source, the first of these that works:
+//   1. FICLONE: a reflink, the new file shares the source's blocks (btrfs, XFS; only with a single source)
+//   2. copy_file_range(2): copied inside the kernel (or offloaded by NFS / SMB servers)
+//   3. sendfile(2): still no user space buffer, works across filesystems on older kernels
+//   4. a read/write loop, e.g. for /proc files and pipes, or elsewhere than Linux
+// It stands in for the system's cat only: with cat missing from the search path, or another cat ahead of it, the
+// line runs the normal way. Like a builtin it runs right in the shell, so launch_line only takes it for a line of
+// a single group, where there's nothing after it to hold up.
+const char* system_cats[] = {"/bin/cat", "/usr/bin/cat"};
+
+// is_copy_command - whether the stage is the system's cat with only plain file operands (or only a < source), and a > target
+int is_copy_command(struct Stage* stage)
+{
+        if (strcmp(stage->argv[0], "cat") != 0 || stage->output_count == 0)
+        {
+                return 0;
+        }
+        if (stage->argc == 1 && stage->input_file == NULL)
+        {
+                return 0;
+        }
+        if (stage->argc > 1 && stage->input_file != NULL)
+        {
+                return 0;
+        }
+        for (int i = 1; i < stage->argc; i++)
+        {
+                if (stage->argv[i][0] == '-')                           // Options and "-" (stdin) are left to cat
+                {
+                        return 0;
+                }
+        }
+        struct HashEntry* cat = lookup_command("cat");                  // What the search path would run
+        for (size_t i = 0; cat != NULL && i < sizeof(system_cats) / sizeof(system_cats[0]); i++)
+        {
+                if (strcmp(cat->full_path, system_cats[i]) == 0)
+                {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+// run_copy_command - the copy itself. Returns cat's exit status: 1 if any source couldn't be copied.
+int run_copy_command(struct Stage* stage)
+{
+        int destination = open(stage->output_files[0], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (destination == -1)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return 1;
+        }
+        struct stat destination_info;
+        fstat(destination, &destination_info);
+
+        int status = 0;
+        int source_count = stage->argc == 1 ? 1 : stage->argc - 1;
+        for (int i = 0; i < source_count; i++)
+        {
+                const char* path = stage->argc == 1 ? stage->input_file : stage->argv[i + 1];
+                int source = open(path, O_RDONLY | O_CLOEXEC);
+                struct stat source_info;
+                if (source == -1 || fstat(source, &source_info) == -1
+                        || (source_info.st_dev == destination_info.st_dev && source_info.st_ino == destination_info.st_ino))
+                {
+                        // Case: missing, or the > target itself (cat refuses: "input file is output file")
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        status = 1;
+                }
+                else if (copy_file(source, destination, &source_info, source_count == 1) == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        status = 1;
+                }
+                if (source != -1)
+                {
+                        close(source);
+                }
+        }
+        close(destination);
+        return copy_to_other_targets(stage) == 0 ? status : 1;
+}
+
+
+// copy_to_other_targets - "cmd > a > b > c" for builtins and copies: they write a, which is then copied to b and c.
+// Returns 0, or 1 if a target couldn't be written.
+int copy_to_other_targets(struct Stage* stage)
+{
+        if (stage->output_count < 2)
+        {
+                return 0;
+        }
+        int source = open(stage->output_files[0], O_RDONLY | O_CLOEXEC);
+        struct stat source_info;
+        if (source == -1 || fstat(source, &source_info) == -1)
+        {
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                if (source != -1)
+                {
+                        close(source);
+                }
+                return 1;
+        }
+        int status = 0;
+        for (int i = 1; i < stage->output_count; i++)
+        {
+                struct stat target_info;
+                if (stat(stage->output_files[i], &target_info) == 0
+                        && target_info.st_dev == source_info.st_dev && target_info.st_ino == source_info.st_ino)
+                {
+                        continue;                                       // Case: "> a > a", truncating it would lose the output
+                }
+                int target = open(stage->output_files[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (target == -1 || lseek(source, 0, SEEK_SET) == -1 || copy_file(source, target, &source_info, 1) == -1)
+                {
+                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                        status = 1;
+                }
+                if (target != -1)
+                {
+                        close(target);
+                }
+        }
+        close(source);
+        return status;
+}
+
+
+// copy_file - appends all of source to destination (at their file offsets). may_clone: destination is empty and
+// gets nothing else, so it can become a reflink of the whole source.
+int copy_file(int source, int destination, struct stat* source_info, int may_clone)
+{
+#ifdef __linux__
+        // Size 0 regular files (/proc, /sys) have to be read to find out what's in them
+        if (S_ISREG(source_info->st_mode) && source_info->st_size > 0)
+        {
+#ifdef FICLONE
+                if (may_clone && ioctl(destination, FICLONE, source) == 0)
+                {
+                        return 0;
+                }
+#endif
+                ssize_t copied;
+                while ((copied = copy_file_range(source, NULL, destination, NULL, SPLICE_CHUNK * 64, 0)) > 0)
+                {
+                }
+                if (copied == 0)
+                {
+                        return 0;
+                }
+                // EBADF: destination opened O_APPEND (e.g. the shell's own stdout), which copy_file_range refuses
+                if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+                {
+                        return -1;
+                }
+                // Whatever copy_file_range already copied has moved both offsets, sendfile carries on from there
+                while ((copied = sendfile(destination, source, NULL, SPLICE_CHUNK * 64)) > 0)
+                {
+                }
+                if (copied == 0)
+                {
+                        return 0;
+                }
+                if (errno != EINVAL && errno != ENOSYS)
+                {
+                        return -1;
+                }
+        }
+#endif
+        char buffer[MAX_REDIRECTED_OUTPUT];
+        ssize_t bytes_read;
+        while ((bytes_read = read(source, buffer, sizeof(buffer))) > 0)
+        {
+                if (write_all(destination, buffer, bytes_read) == -1)
+                {
+                        return -1;
+                }
+        }
+        return bytes_read == 0 ? 0 : -1;
+}
+
+
+////// THREADED FILTERS
+
+// With -t (or QISH_THREADS set), pipeline stages that are simple byte-stream filters run as threads in the shell
+// instead of forked and exec'd processes: head, wc, grep -F, tr and cut, in the forms parse_filter understands.
+// Anything else (an unknown option, a file operand, a regex) still runs the real command.
+//
+// A filter thread owns dups of its stage's input and output fds and moves 256KB at a time between them. When it is
+// done it doesn't close them (the shell could reuse the numbers while a forked child is closing the filter fds it
+// inherited): it dup3s /dev/null over both instead, which drops its end of each pipe right away. head does that as
+// soon as it has its lines, so the stage feeding it gets EPIPE and finishes early instead of running to completion.
+// It then writes its Filter* to filter_done_pipe, which sits in the reaper's epoll set; reap_children joins it,
+// closes its fds and credits it to its job like an exited process. Only used when the epoll reaper is (Linux).
+
+#define FILTER_BUFFER (256 * 1024)
+#define MAX_CUT_RANGES 32
+
+enum FilterType { FILTER_HEAD, FILTER_WC, FILTER_GREP, FILTER_TR, FILTER_CUT };
+const char* filter_names[] = {"head", "wc", "grep", "tr", "cut"};
+
+struct Filter {
+        int type;
+        int in;                         // dups of the stage's fds, owned by the filter
+        int out;
+        int job;                        // index into jobs
+        int role;                       // PROCESS_* bits, as for a process
+        pid_t tid;                      // for its trace lane (see TRACING)
+        int timed_row;                  // its row in a timed line, -1 if none (see TIME)
+        double started;
+        double finished;
+        int status;                     // exit status, like the command's
+        struct rusage usage;            // the thread's own CPU time
+        pthread_t thread;
+        struct Filter* next;            // running_filters
+
+        long count;                     // head: lines
+        int counts;                     // wc: WC_* bits
+        int invert;                     // grep -v
+        int count_only;                 // grep -c
+        char* pattern;                  // grep: malloc'd, the line doesn't outlive the arena
+        size_t pattern_length;
+        unsigned char map[256];         // tr: byte -> byte
+        unsigned char drop[256];        // tr -d: bytes to delete
+        char delimiter;                 // cut -f
+        int by_field;                   // cut -f, or -c / -b
+        long ranges[MAX_CUT_RANGES][2]; // cut: 1 based, inclusive, LONG_MAX for N-
+        int range_count;
+
+        char* buffer;                   // input, FILTER_BUFFER (grows for a longer line)
+        size_t capacity;
+        size_t start;                   // unread input is buffer[start, end)
+        size_t end;
+        int at_eof;
+        char* output;                   // FILTER_BUFFER, flushed when full
+        size_t output_length;
+        int broken;                     // output failed (e.g. EPIPE: the reader is gone)
+};
+
+enum WcCount { WC_LINES = 1, WC_WORDS = 2, WC_BYTES = 4 };
+
+
+// parse_filter - a Filter for argv if it is a filter form the shell can run itself, NULL otherwise
+struct Filter* parse_filter(char** argv)
+{
+        struct Filter* filter = calloc(1, sizeof(struct Filter));
+        if (filter == NULL)
+        {
+                return NULL;
+        }
+        int parsed = -1;
+        if (strcmp(argv[0], "head") == 0)
+        {
+                filter->type = FILTER_HEAD;
+                parsed = parse_head(filter, argv);
+        }
+        else if (strcmp(argv[0], "wc") == 0)
+        {
+                filter->type = FILTER_WC;
+                parsed = parse_wc(filter, argv);
+        }
+        else if (strcmp(argv[0], "grep") == 0)
+        {
+                filter->type = FILTER_GREP;
+                parsed = parse_grep(filter, argv);
+        }
+        else if (strcmp(argv[0], "tr") == 0)
+        {
+                filter->type = FILTER_TR;
+                parsed = parse_tr(filter, argv);
+        }
+        else if (strcmp(argv[0], "cut") == 0)
+        {
+                filter->type = FILTER_CUT;
+                parsed = parse_cut(filter, argv);
+        }
+        if (parsed == -1)
+        {
+                free_filter(filter);
+                return NULL;
+        }
+        return filter;
+}
+
+
+// parse_count - a whole non-negative decimal number, -1 otherwise
+long parse_count(const char* text)
+{
+        if (*text == '\0' || strlen(text) > 18)
+        {
+                return -1;
+        }
+        long value = 0;
+        for (; *text != '\0'; text++)
+        {
+                if (*text < '0' || *text > '9')
+                {
+                        return -1;
+                }
+                value = value * 10 + (*text - '0');
+        }
+        return value;
+}
+
+
+// parse_head - head, head -n N, head -nN, head -N
+int parse_head(struct Filter* filter, char** argv)
+{
+        filter->count = 10;
+        if (argv[1] == NULL)
+        {
+                return 0;
+        }
+        const char* count = NULL;
+        int next = 2;
+        if (strcmp(argv[1], "-n") == 0)
+        {
+                count = argv[2];
+                next = 3;
+        }
+        else if (strncmp(argv[1], "-n", 2) == 0)
+        {
+                count = argv[1] + 2;
+        }
+        else if (argv[1][0] == '-')
+        {
+                count = argv[1] + 1;
+        }
+        if (count == NULL || argv[next - 1] == NULL || argv[next] != NULL)
+        {
+                return -1;
+        }
+        filter->count = parse_count(count);
+        return filter->count == -1 ? -1 : 0;
+}
+
+
+// parse_wc - wc with any of -l -w -c (bundled or not), all three by default
+int parse_wc(struct Filter* filter, char** argv)
+{
+        for (int i = 1; argv[i] != NULL; i++)
+        {
+                if (argv[i][0] != '-' || argv[i][1] == '\0')
+                {
+                        return -1;
+                }
+                for (const char* flag = argv[i] + 1; *flag != '\0'; flag++)
+                {
+                        if (*flag == 'l')
+                        {
+                                filter->counts |= WC_LINES;
+                        }
+                        else if (*flag == 'w')
+                        {
+                                filter->counts |= WC_WORDS;
+                        }
+                        else if (*flag == 'c')
+                        {
+                                filter->counts |= WC_BYTES;
+                        }
+                        else
+                        {
+                                return -1;
+                        }
+                }
+        }
+        if (filter->counts == 0)
+        {
+                filter->counts = WC_LINES | WC_WORDS | WC_BYTES;
+        }
+        return 0;
+}
+
+
+// parse_grep - grep [-F] [-v] [-c] PATTERN. Without -F the pattern must not use any regex syntax.
+int parse_grep(struct Filter* filter, char** argv)
+{
+        int fixed = 0;
+        int i = 1;
+        for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+        {
+                for (const char* flag = argv[i] + 1; *flag != '\0'; flag++)
+                {
+                        if (*flag == 'F')
+                        {
+                                fixed = 1;
+                        }
+                        else if (*flag == 'v')
+                        {
+                                filter->invert = 1;
+                        }
+                        else if (*flag == 'c')
+                        {
+                                filter->count_only = 1;
+                        }
+                        else
+                        {
+                                return -1;
+                        }
+                }
+        }
+        if (argv[i] == NULL || argv[i + 1] != NULL || strchr(argv[i], '\n') != NULL)
+        {
+                return -1;
+        }
+        if (!fixed && strpbrk(argv[i], ".[]*^$\\") != NULL)
+        {
+                return -1;
+        }
+        filter->pattern = strdup(argv[i]);
+        filter->pattern_length = strlen(argv[i]);
+        return filter->pattern == NULL ? -1 : 0;
+}
+
+
+// parse_tr_set - expands a tr set (escapes and a-z ranges) into set, returns its length or -1.
+// Classes, equivalence classes and repeats ([:alpha:], [=a=], [a*3]) are left to the real tr.
+int parse_tr_set(const char* text, unsigned char* set)
+{
+        int length = 0;
+        while (*text != '\0')
+        {
+                int c = (unsigned char) *text++;
+                if (c == '[')
+                {
+                        return -1;
+                }
+                if (c == '\\' && *text != '\0')
+                {
+                        const char* escapes = "n\nt\tr\rf\fv\va\ab\b\\\\";
+                        const char* escape = strchr(escapes, *text);
+                        if (escape == NULL || (escape - escapes) % 2 != 0)
+                        {
+                                return -1;
+                        }
+                        c = (unsigned char) escape[1];
+                        text++;
+                }
+                if (text[0] == '-' && text[1] != '\0')
+                {
+                        int last = (unsigned char) text[1];
+                        if (last == '\\' || last == '[' || last < c)
+                        {
+                                return -1;
+                        }
+                        text += 2;
+                        if (length + (last - c + 1) > 256)
+                        {
+                                return -1;
+                        }
+                        for (; c <= last; c++)
+                        {
+                                set[length++] = c;
+                        }
+                        continue;
+                }
+                if (length == 256)
+                {
+                        return -1;
+                }
+                set[length++] = c;
+        }
+        return length;
+}
+
+
+// parse_tr - tr SET1 SET2 (SET2 padded with its last byte), or tr -d SET1
+int parse_tr(struct Filter* filter, char** argv)
+{
+        unsigned char from[256];
+        unsigned char to[256];
+        for (int c = 0; c < 256; c++)
+        {
+                filter->map[c] = c;
+        }
+        if (argv[1] == NULL || argv[2] == NULL)
+        {
+                return -1;
+        }
+        if (strcmp(argv[1], "-d") == 0)
+        {
+                int length = argv[3] == NULL ? parse_tr_set(argv[2], from) : -1;
+                for (int i = 0; i < length; i++)
+                {
+                        filter->drop[from[i]] = 1;
+                }
+                return length == -1 ? -1 : 0;
+        }
+        if (argv[1][0] == '-' || argv[3] != NULL)
+        {
+                return -1;
+        }
+        int from_length = parse_tr_set(argv[1], from);
+        int to_length = parse_tr_set(argv[2], to);
+        if (from_length == -1 || to_length <= 0)
+        {
+                return -1;
+        }
+        for (int i = 0; i < from_length; i++)
+        {
+                filter->map[from[i]] = to[i < to_length ? i : to_length - 1];
+        }
+        return 0;
+}
+
+
+// parse_cut_list - cut's LIST: N, N-M, N-, -M separated by commas
+int parse_cut_list(struct Filter* filter, const char* list)
+{
+        char copy[256];
+        if (strlen(list) >= sizeof(copy))
+        {
+                return -1;
+        }
+        strcpy(copy, list);
+        char* saved = NULL;
+        for (char* part = strtok_r(copy, ",", &saved); part != NULL; part = strtok_r(NULL, ",", &saved))
+        {
+                if (filter->range_count == MAX_CUT_RANGES)
+                {
+                        return -1;
+                }
+                char* dash = strchr(part, '-');
+                long first;
+                long last;
+                if (dash == NULL)
+                {
+                        first = last = parse_count(part);
+                }
+                else
+                {
+                        *dash = '\0';
+                        first = part[0] == '\0' ? 1 : parse_count(part);
+                        last = dash[1] == '\0' ? LONG_MAX : parse_count(dash + 1);
+                        if (part[0] == '\0' && dash[1] == '\0')
+                        {
+                                return -1;
+                        }
+                }
+                if (first < 1 || last < first)
+                {
+                        return -1;
+                }
+                filter->ranges[filter->range_count][0] = first;
+                filter->ranges[filter->range_count][1] = last;
+                filter->range_count++;
+        }
+        return filter->range_count > 0 ? 0 : -1;
+}
+
+
+// parse_cut - cut -f LIST [-d C], or cut -c LIST / -b LIST (bytes), each option joined to its value or not
+int parse_cut(struct Filter* filter, char** argv)
+{
+        filter->delimiter = '\t';
+        const char* list = NULL;
+        int has_delimiter = 0;
+        for (int i = 1; argv[i] != NULL; i++)
+        {
+                if (argv[i][0] != '-' || strchr("fcbd", argv[i][1]) == NULL || argv[i][1] == '\0')
+                {
+                        return -1;
+                }
+                char option = argv[i][1];
+                const char* value = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+                if (value == NULL)
+                {
+                        return -1;
+                }
+                if (option == 'd')
+                {
+                        if (strlen(value) != 1)
+                        {
+                                return -1;
+                        }
+                        filter->delimiter = value[0];
+                        has_delimiter = 1;
+                        continue;
+                }
+                if (list != NULL)
+                {
+                        return -1;
+                }
+                list = value;
+                filter->by_field = (option == 'f');
+        }
+        if (list == NULL || (has_delimiter && !filter->by_field))
+        {
+                return -1;
+        }
+        return parse_cut_list(filter, list);
+}
+
+
+// start_filter - runs the stage as a filter thread of the job, reading in and writing out (neither is taken over).
+// Returns 0, or -1 if it has to run as a process after all.
+int start_filter(struct Filter* filter, int job, int role, int in, int out)
+{
+        if (null_fd == -1)
+        {
+                null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        }
+        if (filter_done_pipe[0] == -1 && null_fd != -1)
+        {
+#ifdef __linux__
+                if (pipe2(filter_done_pipe, O_CLOEXEC) == 0)
+                {
+                        fcntl(filter_done_pipe[0], F_SETFL, O_NONBLOCK);
+                        struct epoll_event event = {.events = EPOLLIN, .data.fd = filter_done_pipe[0]};
+                        epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, filter_done_pipe[0], &event);
+                }
+#endif
+        }
+        if (filter_done_pipe[0] == -1)
+        {
+                return -1;
+        }
+
+        filter->job = job;
+        filter->role = role;
+        filter->started = trace_now();
+        filter->in = fcntl(in, F_DUPFD_CLOEXEC, 3);
+        filter->out = fcntl(out, F_DUPFD_CLOEXEC, 3);
+        filter->capacity = FILTER_BUFFER;
+        filter->buffer = malloc(FILTER_BUFFER);
+        filter->output = malloc(FILTER_BUFFER);
+        if (filter->in == -1 || filter->out == -1 || filter->buffer == NULL || filter->output == NULL
+                || pthread_create(&filter->thread, NULL, run_filter, filter) != 0)
+        {
+                close(filter->in);
+                close(filter->out);
+                return -1;
+        }
+        filter->next = running_filters;
+        running_filters = filter;
+        jobs[job].remaining++;
+        jobs[job].sinks_left += (role & PROCESS_SINK) != 0;
+        return 0;
+}
+
+
+// run_filter - the filter thread
+void* run_filter(void* argument)
+{
+        struct Filter* filter = argument;
+#ifdef __linux__
+        filter->tid = syscall(SYS_gettid);
+#endif
+        switch (filter->type)
+        {
+        case FILTER_HEAD:
+                filter_head(filter);
+                break;
+        case FILTER_WC:
+                filter_wc(filter);
+                break;
+        case FILTER_GREP:
+                filter_grep(filter);
+                break;
+        case FILTER_TR:
+                filter_tr(filter);
+                break;
+        case FILTER_CUT:
+                filter_cut(filter);
+                break;
+        }
+        filter_flush(filter);
+        if (filter->broken)
+        {
+                filter->status = 128 + SIGPIPE;                         // What the command would have died of
+        }
+
+        // Drop both pipe ends now, the shell closes the fds once it has joined the thread
+#ifdef __linux__
+        dup3(null_fd, filter->in, O_CLOEXEC);
+        dup3(null_fd, filter->out, O_CLOEXEC);
+        getrusage(RUSAGE_THREAD, &filter->usage);
+#endif
+        filter->finished = trace_now();
+        while (write(filter_done_pipe[1], &filter, sizeof(filter)) == -1 && errno == EINTR)
+        {
+        }
+        return NULL;
+}
+
+
+// filter_read - reads more input after buffer[end], returns 0 at EOF (or on error)
+int filter_read(struct Filter* filter)
+{
+        if (filter->at_eof)
+        {
+                return 0;
+        }
+        if (filter->start > 0)                                          // Keep the unread part (a partial line) at the front
+        {
+                memmove(filter->buffer, filter->buffer + filter->start, filter->end - filter->start);
+                filter->end -= filter->start;
+                filter->start = 0;
+        }
+        if (filter->end == filter->capacity)                            // Case: one line longer than the buffer
+        {
+                char* grown = realloc(filter->buffer, filter->capacity * 2);
+                if (grown == NULL)
+                {
+                        filter->at_eof = 1;
+                        return 0;
+                }
+                filter->buffer = grown;
+                filter->capacity *= 2;
+        }
+        ssize_t bytes_read;
+        while ((bytes_read = read(filter->in, filter->buffer + filter->end, filter->capacity - filter->end)) == -1 && errno == EINTR)
+        {
+        }
+        if (bytes_read <= 0)
+        {
+                filter->at_eof = 1;
+                return 0;
+        }
+        filter->end += bytes_read;
+        return 1;
+}
+
+
+// filter_next_line - the next input line, with its \n if it has one. Returns 0 at EOF.
+int filter_next_line(struct Filter* filter, char** line, size_t* length)
+{
+        while (1)
+        {
+                char* newline = memchr(filter->buffer + filter->start, '\n', filter->end - filter->start);
+                if (newline != NULL || (filter->at_eof && filter->end > filter->start))
+                {
+                        *line = filter->buffer + filter->start;
+                        *length = newline != NULL ? (size_t) (newline + 1 - *line) : filter->end - filter->start;
+                        filter->start += *length;
+                        return 1;
+                }
+                if (!filter_read(filter) && filter->end == filter->start)
+                {
+                        return 0;
+                }
+        }
+}
+
+
+// filter_write - buffers output, flushing it when FILTER_BUFFER is full
+void filter_write(struct Filter* filter, const char* data, size_t length)
+{
+        if (filter->broken)
+        {
+                return;
+        }
+        if (filter->output_length + length > FILTER_BUFFER)
+        {
+                filter_flush(filter);
+                if (length > FILTER_BUFFER)
+                {
+                        filter->broken = write_all(filter->out, data, length) == -1;
+                        return;
+                }
+        }
+        memcpy(filter->output + filter->output_length, data, length);
+        filter->output_length += length;
+}
+
+
+// filter_flush - writes out the buffered output
+void filter_flush(struct Filter* filter)
+{
+        if (!filter->broken && filter->output_length > 0)
+        {
+                filter->broken = write_all(filter->out, filter->output, filter->output_length) == -1;
+        }
+        filter->output_length = 0;
+}
+
+
+// filter_head - copies input up to the count'th \n, block by block
+void filter_head(struct Filter* filter)
+{
+        long left = filter->count;
+        while (left > 0 && !filter->broken && filter_read(filter))
+        {
+                char* p = filter->buffer;
+                char* end = filter->buffer + filter->end;
+                while (left > 0 && (p = memchr(p, '\n', end - p)) != NULL)
+                {
+                        p++;
+                        left--;
+                }
+                filter_write(filter, filter->buffer, (left == 0 ? p : end) - filter->buffer);
+                filter->end = 0;
+        }
+}
+
+
+// filter_wc - counts like wc: words are runs of non-space bytes
+void filter_wc(struct Filter* filter)
+{
+        long lines = 0;
+        long words = 0;
+        long bytes = 0;
+        int in_word = 0;
+        while (filter_read(filter))
+        {
+                const unsigned char* p = (const unsigned char*) filter->buffer;
+                const unsigned char* end = p + filter->end;
+                bytes += filter->end;
+                if (filter->counts == WC_LINES)                         // Case: wc -l, only newlines matter
+                {
+                        while ((p = memchr(p, '\n', end - p)) != NULL)
+                        {
+                                p++;
+                                lines++;
+                        }
+                }
+                else if (filter->counts != WC_BYTES)
+                {
+                        for (; p < end; p++)
+                        {
+                                int space = char_classes[*p] == CHAR_SPACE || *p == '\n';
+                                lines += (*p == '\n');
+                                words += (!space && !in_word);
+                                in_word = !space;
+                        }
+                }
+                filter->end = 0;
+        }
+
+        // One count is printed bare, several in 7 wide columns (GNU wc on a pipe)
+        long values[3] = {lines, words, bytes};
+        int several = (filter->counts & (filter->counts - 1)) != 0;
+        char text[96];
+        int length = 0;
+        for (int i = 0; i < 3; i++)
+        {
+                if (filter->counts & (1 << i))
+                {
+                        length += snprintf(text + length, sizeof(text) - length, several ? "%s%7ld" : "%s%ld", length > 0 ? " " : "", values[i]);
+                }
+        }
+        text[length++] = '\n';
+        filter_write(filter, text, length);
+}
+
+
+// filter_grep - selects the lines containing pattern (or not, -v), exit status 1 if none
+void filter_grep(struct Filter* filter)
+{
+        long selected = 0;
+        char* line;
+        size_t length;
+        while (!filter->broken && filter_next_line(filter, &line, &length))
+        {
+                size_t text_length = (length > 0 && line[length - 1] == '\n') ? length - 1 : length;
+                int found = filter->pattern_length == 0 || memmem(line, text_length, filter->pattern, filter->pattern_length) != NULL;
+                if (found == filter->invert)
+                {
+                        continue;
+                }
+                selected++;
+                if (!filter->count_only)
+                {
+                        filter_write(filter, line, text_length);
+                        filter_write(filter, "\n", 1);
+                }
+        }
+        if (filter->count_only)
+        {
+                char text[32];
+                filter_write(filter, text, snprintf(text, sizeof(text), "%ld\n", selected));
+        }
+        filter->status = selected > 0 ? 0 : 1;
+}
+
+
+// filter_tr - maps (or deletes) bytes in place, block by block
+void filter_tr(struct Filter* filter)
+{
+        while (!filter->broken && filter_read(filter))
+        {
+                unsigned char* p = (unsigned char*) filter->buffer;
+                size_t kept = 0;
+                for (size_t i = 0; i < filter->end; i++)
+                {
+                        if (!filter->drop[p[i]])
+                        {
+                                p[kept++] = filter->map[p[i]];
+                        }
+                }
+                filter_write(filter, filter->buffer, kept);
+                filter->end = 0;
+        }
+}
+
+
+// cut_selected - whether field / byte number n (1 based) is in the list
+int cut_selected(struct Filter* filter, long n)
+{
+        for (int i = 0; i < filter->range_count; i++)
+        {
+                if (n >= filter->ranges[i][0] && n <= filter->ranges[i][1])
+                {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+// filter_cut - selected fields (in input order, joined by the delimiter) or bytes of each line.
+// Lines without the delimiter are passed through whole, like cut without -s.
+void filter_cut(struct Filter* filter)
+{
+        char* line;
+        size_t length;
+        while (!filter->broken && filter_next_line(filter, &line, &length))
+        {
+                size_t text_length = (length > 0 && line[length - 1] == '\n') ? length - 1 : length;
+                if (!filter->by_field)
+                {
+                        for (size_t i = 0; i < text_length; i++)
+                        {
+                                if (cut_selected(filter, i + 1))
+                                {
+                                        filter_write(filter, line + i, 1);
+                                }
+                        }
+                }
+                else if (memchr(line, filter->delimiter, text_length) == NULL)
+                {
+                        filter_write(filter, line, text_length);
+                }
+                else
+                {
+                        int first = 1;
+                        long field = 1;
+                        char* field_start = line;
+                        char* text_end = line + text_length;
+                        while (field_start <= text_end)
+                        {
+                                char* field_end = memchr(field_start, filter->delimiter, text_end - field_start);
+                                if (field_end == NULL)
+                                {
+                                        field_end = text_end;
+                                }
+                                if (cut_selected(filter, field))
+                                {
+                                        if (!first)
+                                        {
+                                                filter_write(filter, &filter->delimiter, 1);
+                                        }
+                                        filter_write(filter, field_start, field_end - field_start);
+                                        first = 0;
+                                }
+                                field_start = field_end + 1;
+                                field++;
+                        }
+                }
+                filter_write(filter, "\n", 1);
+        }
+}
+
+
+// time_filter - gives a started filter thread its row in a timed line (see TIME)
+void time_filter(struct Filter* filter, int group, int stage, char** argv)
+{
+        filter->timed_row = time_process(-1, group, stage, time_label(argv, " (thread)"));
+}
+
+
+// collect_filters - joins every filter thread that has finished and credits it to its job. Returns how many.
+int collect_filters()
+{
+        int collected = 0;
+        struct Filter* filter;
+        while (filter_done_pipe[0] != -1 && read(filter_done_pipe[0], &filter, sizeof(filter)) == sizeof(filter))
+        {
+                pthread_join(filter->thread, NULL);
+                for (struct Filter** link = &running_filters; *link != NULL; link = &(*link)->next)
+                {
+                        if (*link == filter)
+                        {
+                                *link = filter->next;
+                                break;
+                        }
+                }
+                close(filter->in);
+                close(filter->out);
+                trace_thread(filter_names[filter->type], filter->tid, filter->started, filter->finished);
+                time_finished(filter->timed_row, &filter->usage);
+                credit_job(filter->job, &filter->usage, filter->role, filter->status);
+                free_filter(filter);
+                collected++;
+        }
+        return collected;
+}
+
+
+// close_filter_fds - in a forked child that doesn't exec: it mustn't hold the pipe ends of the shell's filter threads
+void close_filter_fds()
+{
+        for (struct Filter* filter = running_filters; filter != NULL; filter = filter->next)
+        {
+                close(filter->in);
+                close(filter->out);
+        }
+}
+
+
+// free_filter - frees a filter that isn't running
+void free_filter(struct Filter* filter)
+{
+        free(filter->pattern);
+        free(filter->buffer);
+        free(filter->output);
+        free(filter);
+}
+
+
+////// TRACING
+
+// QISH_TRACE=file.json records where the shell's time goes as Chrome trace events, for Perfetto (ui.perfetto.dev)
+// or chrome://tracing. The shell's lane has a span for every line read, the parser's scan and link passes, each
+// command lookup, spawn, builtin, kernel copy, collated output and wait. A spawn span is the fork for the fork
+// backend. With vfork, clone and posix_spawn the shell is suspended until the child has exec'd, so it covers the
+// exec too. Every child (stages, tee and broadcast helpers) gets a lane of its own that spans from its spawn to its
+// reap, with its exit status, and each filter thread (-t) a lane in the shell's process.
+// Events are kept in memory and only written out when the shell exits: while it runs, tracing costs a clock read
+// and an array append. The array is mapped with MADV_DONTFORK, so it doesn't make forks of builtin stages slower.
+
+struct TraceEvent {
+        char phase;                     // 'X' span, 'M' lane name
+        char name[48];
+        const char* category;
+        double start;                   // microseconds since the shell started
+        double duration;
+        pid_t pid;                      // lane
+        pid_t tid;
+        int status;                     // exit status of a process, -1 if none
+};
+
+struct TraceProcess {
+        pid_t pid;
+        double start;
+        char name[48];
+};
+
+
+// start_tracing - opens the trace file, events are written to it by write_trace. -1 if it can't be created.
+int start_tracing(const char* path)
+{
+        trace_file = fopen(path, "we");
+        if (trace_file == NULL)
+        {
+                return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+        trace_pid = getpid();
+        add_trace_event('M', "qish", "shell", trace_pid, trace_pid);
+        return 0;
+}
+
+
+// trace_now - microseconds since tracing started, 0 when not tracing (safe from filter threads)
+double trace_now()
+{
+        if (trace_file == NULL)
+        {
+                return 0;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - trace_epoch.tv_sec) * 1e6 + (now.tv_nsec - trace_epoch.tv_nsec) / 1e3;
+}
+
+
+// add_trace_event - appends an event (the rest of it is zero), NULL if there's no room
+struct TraceEvent* add_trace_event(char phase, const char* name, const char* category, pid_t pid, pid_t tid)
+{
+        if (trace_event_count == trace_event_capacity)
+        {
+                int new_capacity = trace_event_capacity ? trace_event_capacity * 2 : 1024;
+#ifdef __linux__
+                // Mapped apart and left out of forks: every forked builtin stage would copy its page tables otherwise
+                size_t old_size = trace_event_capacity * sizeof(struct TraceEvent);
+                size_t new_size = new_capacity * sizeof(struct TraceEvent);
+                struct TraceEvent* grown = trace_events == NULL ? mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                                                                : mremap(trace_events, old_size, new_size, MREMAP_MAYMOVE);
+                if (grown == MAP_FAILED)
+                {
+                        return NULL;
+                }
+                madvise(grown, new_size, MADV_DONTFORK);
+#else
+                struct TraceEvent* grown = realloc(trace_events, new_capacity * sizeof(struct TraceEvent));
+                if (grown == NULL)
+                {
+                        return NULL;
+                }
+#endif
+                trace_events = grown;
+                trace_event_capacity = new_capacity;
+        }
+        struct TraceEvent* event = &trace_events[trace_event_count++];
+        *event = (struct TraceEvent){phase, "", category, 0, 0, pid, tid, -1};
+        snprintf(event->name, sizeof(event->name), "%s", name);
+        return event;
+}
+
+
+// trace_span - a span of the shell's own lane, from start until now
+void trace_span(const char* name, const char* category, double start)
+{
+        if (trace_file == NULL)
+        {
+                return;
+        }
+        struct TraceEvent* event = add_trace_event('X', name, category, trace_pid, trace_pid);
+        if (event != NULL)
+        {
+                event->start = start;
+                event->duration = trace_now() - start;
+        }
+}
+
+
+// trace_spawn - the shell started pid (-1: failed to) at start: a spawn span, and pid's lane is opened
+void trace_spawn(pid_t pid, const char* name, double start)
+{
+        if (trace_file == NULL)
+        {
+                return;
+        }
+        char span_name[48];
+        snprintf(span_name, sizeof(span_name), "spawn %s", name);
+        trace_span(span_name, "spawn", start);
+        if (pid <= 0)
+        {
+                return;
+        }
+        if (trace_process_count == trace_process_capacity)
+        {
+                int new_capacity = trace_process_capacity ? trace_process_capacity * 2 : 64;
+                struct TraceProcess* grown = realloc(trace_processes, new_capacity * sizeof(struct TraceProcess));
+                if (grown == NULL)
+                {
+                        return;
+                }
+                trace_processes = grown;
+                trace_process_capacity = new_capacity;
+        }
+        struct TraceProcess* process = &trace_processes[trace_process_count++];
+        process->pid = pid;
+        process->start = start;
+        snprintf(process->name, sizeof(process->name), "%s", name);
+}
+
+
+// trace_reap - pid was reaped: its lane gets a span from its spawn until now
+void trace_reap(pid_t pid, int status)
+{
+        for (int i = trace_process_count - 1; i >= 0; i--)
+        {
+                struct TraceProcess process = trace_processes[i];
+                if (process.pid != pid)
+                {
+                        continue;
+                }
+                trace_processes[i] = trace_processes[--trace_process_count];
+                add_trace_event('M', process.name, "process", pid, pid);
+                struct TraceEvent* event = add_trace_event('X', process.name, "process", pid, pid);
+                if (event != NULL)
+                {
+                        event->start = process.start;
+                        event->duration = trace_now() - process.start;
+                        event->status = status;
+                }
+                return;
+        }
+}
+
+
+// trace_thread - a finished filter thread's lane, in the shell's process
+void trace_thread(const char* name, pid_t tid, double start, double end)
+{
+        if (trace_file == NULL)
+        {
+                return;
+        }
+        add_trace_event('M', name, "thread", trace_pid, tid);
+        struct TraceEvent* event = add_trace_event('X', name, "thread", trace_pid, tid);
+        if (event != NULL)
+        {
+                event->start = start;
+                event->duration = end - start;
+        }
+}
+
+
+// write_trace_string - a JSON string
+void write_trace_string(const char* text)
+{
+        fputc('"', trace_file);
+        for (const unsigned char* c = (const unsigned char*) text; *c != '\0'; c++)
+        {
+                if (*c == '"' || *c == '\\')
+                {
+                        fprintf(trace_file, "\\%c", *c);
+                }
+                else if (*c < 0x20)
+                {
+                        fprintf(trace_file, "\\u%04x", *c);
+                }
+                else
+                {
+                        fputc(*c, trace_file);
+                }
+        }
+        fputc('"', trace_file);
+}
+
+
+// write_trace - writes every event to the trace file as {"traceEvents": [...]} and stops tracing
+void write_trace()
+{
+        if (trace_file == NULL)
+        {
+                return;
+        }
+        fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (int i = 0; i < trace_event_count; i++)
+        {
+                struct TraceEvent* event = &trace_events[i];
+                fprintf(trace_file, "{\"ph\": \"%c\", \"pid\": %d, \"tid\": %d, ", event->phase, (int) event->pid, (int) event->tid);
+                if (event->phase == 'M')                                // Lane name: a process, or a filter thread
+                {
+                        fprintf(trace_file, "\"name\": \"%s\", \"args\": {\"name\": ", event->tid != event->pid ? "thread_name" : "process_name");
+                        write_trace_string(event->name);
+                        fputc('}', trace_file);
+                }
+                else
+                {
+                        fprintf(trace_file, "\"ts\": %.3f, \"dur\": %.3f, \"cat\": \"%s\", \"name\": ", event->start, event->duration, event->category);
+                        write_trace_string(event->name);
+                        if (event->status != -1)
+                        {
+                                fprintf(trace_file, ", \"args\": {\"status\": %d}", event->status);
+                        }
+                }
+                fprintf(trace_file, "}%s\n", i < trace_event_count - 1 ? "," : "");
+        }
+        fprintf(trace_file, "]}\n");
+        fclose(trace_file);
+        trace_file = NULL;
+#ifdef __linux__
+        if (trace_events != NULL)
+        {
+                munmap(trace_events, trace_event_capacity * sizeof(struct TraceEvent));
+        }
+#else
+        free(trace_events);
+#endif
+        free(trace_processes);
+        trace_events = NULL;
+        trace_processes = NULL;
+        trace_event_count = trace_event_capacity = 0;
+        trace_process_count = trace_process_capacity = 0;
+}
+
+
+////// METRICS
+
+// QISH_METRICS=file.prom keeps counters and histograms of what the shell does, and writes them to that file in the
+// Prometheus text format when the shell exits, and every QISH_METRICS_INTERVAL seconds (e.g. for node_exporter's
+// textfile collector). The file is written next to it and renamed over it, so a scrape never sees half of it.
+// The counters live in a shared mapping: forked tee and broadcast helpers add the bytes they copied, and children
+// whose exec failed count themselves, straight into the shell's numbers. Histograms are only kept by the shell.
+
+struct MetricCounterName {
+        const char* family;
+        const char* labels;
+        const char* help;               // NULL: same family as the one before
+};
+
+const struct MetricCounterName metric_counter_names[] = {
+        {"qish_forks_total", "kind=\"command\"", "Processes started: commands, forked builtin stages, tee and broadcast helpers."},
+        {"qish_forks_total", "kind=\"builtin\"", NULL},
+        {"qish_forks_total", "kind=\"helper\"", NULL},
+        {"qish_exec_failures_total", "reason=\"not_found\"", "Commands that could not be run: not in any search path, or the spawn or exec failed."},
+        {"qish_exec_failures_total", "reason=\"exec\"", NULL},
+        {"qish_path_probes_total", "", "Search path directories probed (one faccessat each) on command hash misses."},
+        {"qish_copied_bytes_total", "helper=\"tee\"", "Bytes copied by the helpers: > targets of pipeline stages (tee), |+ consumers (broadcast)."},
+        {"qish_copied_bytes_total", "helper=\"broadcast\"", NULL},
+};
+
+struct MetricHistogramName {
+        const char* name;
+        const char* help;
+        const double* bounds;           // upper bounds of the buckets, the last one is +Inf
+        int bound_count;
+};
+
+const double metric_second_bounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const double metric_depth_bounds[] = {1, 2, 3, 4, 6, 8, 16, 32, 64};
+const double metric_width_bounds[] = {1, 2, 4, 8, 16, 32, 64, 128};
+
+const struct MetricHistogramName metric_histogram_names[] = {
+        {"qish_line_duration_seconds", "Time from launching a line until everything it started was reaped.", metric_second_bounds, 16},
+        {"qish_spawn_duration_seconds", "Time the shell spent starting one command (the fork, or vfork/clone/posix_spawn until exec).", metric_second_bounds, 16},
+        {"qish_pipeline_depth", "Stages per pipeline.", metric_depth_bounds, 9},
+        {"qish_parallel_width", "& groups per line.", metric_width_bounds, 8},
+};
+
+struct MetricHistogram {
+        unsigned long buckets[METRIC_BUCKETS];  // observations per bucket (not cumulative), the last one is +Inf
+        unsigned long count;
+        double sum;
+};
+
+struct Metrics {
+        unsigned long counters[METRIC_COUNTER_COUNT];
+        struct MetricHistogram histograms[METRIC_HISTOGRAM_COUNT];
+};
+
+
+// start_metrics - sets up counting, written to path at exit and every interval seconds (NULL or 0: only at exit).
+// -1 if the interval isn't a number, the counters can't be mapped or path can't be written.
+int start_metrics(const char* path, const char* interval)
+{
+        if (interval != NULL)
+        {
+                char* end;
+                long seconds = strtol(interval, &end, 10);
+                if (*interval == '\0' || *end != '\0' || seconds < 0 || seconds > INT_MAX)
+                {
+                        return -1;
+                }
+                metrics_interval = seconds;
+        }
+        metrics = mmap(NULL, sizeof(struct Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        metrics_path = malloc(strlen(path) + 1);
+        metrics_temporary_path = malloc(strlen(path) + 5);
+        if (metrics == MAP_FAILED || metrics_path == NULL || metrics_temporary_path == NULL)
+        {
+                metrics = NULL;
+                return -1;
+        }
+        strcpy(metrics_path, path);
+        sprintf(metrics_temporary_path, "%s.tmp", path);
+        metrics_due = metrics_now() + metrics_interval;
+#ifdef __linux__
+        // Wakes the reaper while it waits for long running commands (see reap_children)
+        if (metrics_interval > 0 && (metrics_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) != -1)
+        {
+                struct itimerspec period = {{metrics_interval, 0}, {metrics_interval, 0}};
+                timerfd_settime(metrics_timer_fd, 0, &period, NULL);
+        }
+#endif
+        return write_metrics();                                         // All zero, but it shows the file can be written
+}
+
 
-// split_input_redir_operator - parses and generates the args array and does redirection operator (>) splitting
-// parses arguments from null terminated char array, puts them into array of strings
-void split_input_redir_operator(char* parsed_input, char** args)
+// metrics_now - seconds on the monotonic clock
+double metrics_now()
 {
-        // parse input in here and set those variables
-        // btw: args need to be NULL terminated
-        char* token;
-        int arg_count = 0;
-
-        while ((token = strsep(&parsed_input, " ")) != NULL) {
-                if (*token == '\0') continue;
-                
-                char* redirect = strchr(token, '>');
-
-                if (redirect != NULL) {
-                        // We found a > character
-                        // Case 1: token is just ">" 
-                        if (strlen(token) == 1) {
-                                args[arg_count++] = strdup(">");
-                                number_of_args++;       // Memory Counter
-                                continue;
-                        }
-                        
-                        // Case 2: ">filename"
-                        if (redirect == token) {
-                                args[arg_count++] = strdup(">");
-                                args[arg_count++] = strdup(redirect + 1);
-                                number_of_args+=2;       // Memory counter
-                                continue;
-                        }
-                        
-                        // Case 3: "filename>"
-                        if (*(redirect + 1) == '\0') {
-                                *redirect = '\0';  // Split at >
-                                args[arg_count++] = strdup(token);
-                                args[arg_count++] = strdup(">");
-                                number_of_args+=2;       // Memory counter
-                                continue;
-                        }
-                        
-                        // Case 4: "filename>filename"
-                        *redirect = '\0';  // Split at >
-                        args[arg_count++] = strdup(token);
-                        args[arg_count++] = strdup(">");
-                        args[arg_count++] = strdup(redirect + 1);
-                        number_of_args+=3;       // Memory counter
-                        continue;
-                }
-                // Normal token without >
-                args[arg_count++] = strdup(token);
-                number_of_args++;       // Memory Counter
-        }
-        args[arg_count] = NULL;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
 }
 
 
-// null_terminate_input - replaces the \n with \0 from raw input
-void null_terminate_input(char* parsed_input, char* raw_input)
+// count_metric - adds amount to a counter (safe from forked helpers, which share the counters)
+void count_metric(int counter, unsigned long amount)
 {
-        int count = 0;
-        while (*raw_input != '\n')
+        if (metrics != NULL)
         {
-                parsed_input[count] = *raw_input;
-                raw_input++;
-                count++;
+                __atomic_fetch_add(&metrics->counters[counter], amount, __ATOMIC_RELAXED);
         }
-        parsed_input[count] = '\0';
 }
 
 
-// collapse_white_space_group - Collapses groups of blank space of input, giving the output at dest.
-// For every string ending though: between the last char and /0 space, delete any blank space
-void collapse_white_space_group(char *dest, char *input)
+// observe_metric - puts value into a histogram's bucket (shell only)
+void observe_metric(int histogram, double value)
 {
-        int count = 0;
-        int insertion_index = 0;
-
-        // Collapses all space groups into one space
-        while (input[count] != '\0')
+        if (metrics == NULL)
         {
-                if (isspace(input[count]))                    // Found a space at this position
-                {
-                        dest[insertion_index] = ' ';          // Place a space at this position
-                        while (isspace(input[count]))         // Go to next non space char.
-                        {
-                                count++;
-                        }
-                        insertion_index++;
-                }
-                else                                          // Character here
-                {
-                        dest[insertion_index] = input[count];
-                        count++;
-                        insertion_index++;
-                }
-
+                return;
         }
-        // Check if slot before is a space, then null terminate it before.
-        if (dest[insertion_index-1] == ' ')
+        const struct MetricHistogramName* name = &metric_histogram_names[histogram];
+        struct MetricHistogram* observed = &metrics->histograms[histogram];
+        int bucket = 0;
+        while (bucket < name->bound_count && value > name->bounds[bucket])
         {
-                dest[insertion_index-1] = '\0';
+                bucket++;
         }
-        else
+        observed->buckets[bucket]++;
+        observed->count++;
+        observed->sum += value;
+}
+
+
+// finish_line_metrics - a line started at start has been reaped. Writes the metrics out if a dump is due.
+void finish_line_metrics(double start)
+{
+        if (metrics == NULL)
         {
-                dest[insertion_index] = '\0';
+                return;
         }
+        observe_metric(METRIC_LINE_SECONDS, metrics_now() - start);
+        write_metrics_if_due();
 }
 
 
-// TODO: Leaked memory due to strdup and other string operations
-// parse_operator_in_args: looks through the current args for symbol (& or |) and "detaches" it as a separates string in the same position
-// E.g. parse_operator_in_args(args, "&"): {"ls&ls"} -> {"ls", "&"", "ls"}
-// parse_operator_in_args(args, "|"): args {"ls|wc", ">", "output.txt"} -> {"ls", "|", "wc", ">", "output.txt"}
-void parse_operator_in_args(char ***args, const char symbol)
+// write_metrics_if_due - writes the metrics out if the interval has passed since the last time
+void write_metrics_if_due()
 {
-        char symbol_str_form[2];
-        symbol_str_form[0] = symbol;
-        symbol_str_form[1] = '\0';
-        
-        int index = 0;
-        int new_args_index = 0;
-        int temp_number_of_args = 0;
+        if (metrics == NULL || metrics_interval == 0 || metrics_now() < metrics_due)
+        {
+                return;
+        }
+        metrics_due = metrics_now() + metrics_interval;
+        write_metrics();
+}
+
+
+// write_metric_counter - one counter sample, with its HELP and TYPE lines when help isn't NULL
+void write_metric_counter(FILE* file, const char* family, const char* labels, const char* help, unsigned long value)
+{
+        if (help != NULL)
+        {
+                fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", family, help, family);
+        }
+        fprintf(file, *labels != '\0' ? "%s{%s} %lu\n" : "%s%s %lu\n", family, labels, value);
+}
 
-        char** new_args = malloc(MAXARGS * sizeof(char *));
-        char** dereferenced_args = *args;
 
-        while (dereferenced_args[index] != NULL)
+// write_metrics - writes every counter and histogram to the metrics file. -1 if it can't be written.
+int write_metrics()
+{
+        if (metrics == NULL)
+        {
+                return 0;
+        }
+        FILE* file = fopen(metrics_temporary_path, "we");
+        if (file == NULL)
+        {
+                return -1;
+        }
+        write_metric_counter(file, "qish_lines_total", "", "Command lines run.", lines_launched);
+        write_metric_counter(file, "qish_command_hash_lookups_total", "result=\"hit\"", "Command lookups, answered by the command hash (hit) or the search paths (miss).", hash_hits);
+        write_metric_counter(file, "qish_command_hash_lookups_total", "result=\"miss\"", NULL, hash_misses);
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+        {
+                const struct MetricCounterName* name = &metric_counter_names[i];
+                write_metric_counter(file, name->family, name->labels, name->help, __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED));
+        }
+        for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
         {
-                char* parallel = strchr(dereferenced_args[index], symbol);
-                if (parallel != NULL)                           // Character exists in this string
+                const struct MetricHistogramName* name = &metric_histogram_names[i];
+                struct MetricHistogram* observed = &metrics->histograms[i];
+                fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name->name, name->help, name->name);
+                unsigned long cumulative = 0;
+                for (int bucket = 0; bucket <= name->bound_count; bucket++)
                 {
-                        // Process the item until no more & is found
-                        char* current = dereferenced_args[index];                    // index of current position in string
-                        
-                        // Case: the | is the only thing in here
-                        if (strlen(current) == 1)
+                        cumulative += observed->buckets[bucket];
+                        if (bucket < name->bound_count)
                         {
-                                new_args[new_args_index++] = strdup(symbol_str_form);
-                                temp_number_of_args++;       // Memory Counter
-                                index++;
-                                continue;
+                                fprintf(file, "%s_bucket{le=\"%g\"} %lu\n", name->name, name->bounds[bucket], cumulative);
                         }
-                        while (1)
+                        else
                         {
-                                parallel = strchr(current, symbol);
-
-                                // Case: there are no more &s
-                                if (parallel == NULL)
-                                {
-                                        if (*current != '\0')            // Case: if there are more characters at this point
-                                        {
-                                                new_args[new_args_index++] = strdup(current);
-                                                temp_number_of_args++;       // Memory Counter
-                                        }
-                                        break;
-                                }
-                                
-                                // FOR MEMORY: save parallel original character first
-                                char temp = *parallel;
-                                
-                                // Case: there are more symbols
-                                // terminate this character in current string
-                                *parallel = '\0';
-                                
-                                // add the part before if not empty
-                                if (*current != '\0')
-                                {
-                                        new_args[new_args_index++] = strdup(current);
-                                        temp_number_of_args++;       // Memory Counter
-                                }
-                                
-                                // add the symbol token
-                                new_args[new_args_index++] = strdup(symbol_str_form);
-                                temp_number_of_args++;       // Memory Counter
-                                
-                                current = parallel+1;
-
-                                // FOR MEMORY: set parallel back to original value
-                                *parallel = temp;
+                                fprintf(file, "%s_bucket{le=\"+Inf\"} %lu\n", name->name, cumulative);
                         }
                 }
-                else
-                {
-                        new_args[new_args_index++] = strdup(dereferenced_args[index]);
-                        temp_number_of_args++;       // Memory Counter
-                }
-                index++;
+                fprintf(file, "%s_sum %.9g\n%s_count %lu\n", name->name, observed->sum, name->name, observed->count);
         }
-        new_args[new_args_index] = NULL;
-
-        free_args_elements(dereferenced_args);
-        free(dereferenced_args);
-        number_of_args = temp_number_of_args;
-        *args = new_args;
+        if (fclose(file) != 0 || rename(metrics_temporary_path, metrics_path) != 0)
+        {
+                unlink(metrics_temporary_path);
+                return -1;
+        }
+        return 0;
 }
 
 
-// configure_redirection - check for redirection operators (>) and configure output to the specific file
-// PRECONDITION: args is a single process' command, therefore there shouldn't exist characters after the filename
-// NOTE that item of args is terminated by a NULL pointer, therefore we check args[count] != NULL. 
-void configure_redirection(char **args)
+// stop_metrics - writes the metrics out one last time and stops counting
+void stop_metrics()
 {
-        int count = 0;
-        while (args[count] != NULL && strcmp(args[count], ">") != 0) 
-        {
-                count++;
-        }
-        
-        if (args[count] == NULL)                                                // Case: no redirection operators
+        if (metrics == NULL)
         {
                 return;
         }
-        if (args[count+1] == NULL || strcmp(args[count+1], ">") == 0)           // Case: doesn't exist any valid file/directory after the redirection character
+        if (write_metrics() == -1)
         {
                 write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                exit(1);                                                        // Exits this specific process, keeps looking for the next command though.
         }
-        if (args[count+1] != NULL && args[count+2] != NULL)                     // check for multiple redirection operators / files to the right
+        munmap(metrics, sizeof(struct Metrics));
+        metrics = NULL;
+        free(metrics_path);
+        free(metrics_temporary_path);
+        if (metrics_timer_fd != -1)
         {
-                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                exit(1);
-        }
-        
-        // Delete redirection operator by null termination
-        free(args[count]);
-        args[count] = NULL;
-        
-        // Setup redirection
-        // Note: args[count] is >
-        int fd = open(args[count+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                exit(1);
+                close(metrics_timer_fd);
+                metrics_timer_fd = -1;
         }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
 }
 
 
-// configure_parallel - returns number of parallel commands there are
-// Precondition - args is well parsed, meaning that any meaningful symbol is separated as an individual item.
-// The function then separates args based on &, and puts each separate array of strings into arg_list
-int configure_parallel(char ***arg_list, char **args)
-{
-        int commands_count = 0;
-        int index = 0;
-        int set_pointer = 1;
+////// TIME
 
-        // Handle single & case
-        if (args[0] != NULL && strcmp("&", args[0]) == 0 && args[1] == NULL) {
-                return 0;  // No commands to run
-        }
+// time a | b & c runs the line as usual, then reports on stderr where its time went. Every stage, tee or broadcast
+// helper and filter thread gets a row with its wall time, user and system CPU, max RSS and voluntary / involuntary
+// context switches, and so does every & group and the whole line. A process's usage is the rusage wait4 hands back
+// when it is reaped and its wall time runs from its spawn until then, a filter thread's comes from RUSAGE_THREAD.
+// Builtins and kernel copies run in the shell itself: they get the shell's own usage while they ran.
+// Background lines (time a &) aren't timed, they aren't waited for.
 
-        int ended_with_amp = 0;
+struct TimedProcess {
+        pid_t pid;                      // -1: a filter thread, or something that ran in the shell
+        int group;                      // & group, 0 based
+        int stage;                      // in that group, 0 based (a helper gets the stage it copies for)
+        const char* label;              // in the line's arena
+        double started;
+        double ended;                   // 0 until it's done
+        struct rusage usage;
+};
 
-        // assume args terminates by the null pointer
-        while (args[index] != NULL)
-        {
-                if (set_pointer)                                // Case: not &
-                {
-                        // Error if first token is &
-                        if (strcmp("&", args[index]) == 0) {
-                                return -1;  // Invalid format
-                        }
 
-                        // Set the command arglist to be the beginning of each command
-                        arg_list[commands_count] = args+index;
-                        set_pointer = 0;
-                }
-                else if (strcmp("&", args[index]) == 0)         // Case: yes &
-                {
-                        free(args[index]);
-                        args[index] = NULL;
-                        set_pointer = 1;
-                        ended_with_amp = 1;
-                        commands_count++;
-                }
-                index++;
+// start_timing - times the line about to be launched, with group_count & groups
+void start_timing(int group_count)
+{
+        timing = 1;
+        timing_started = metrics_now();
+        timed_processes = NULL;                                         // The last line's went with its arena
+        timed_count = 0;
+        timed_capacity = 0;
+        timed_group_starts = arena_alloc(line_arena, group_count * sizeof(double));
+        timed_group_count = group_count;
+        for (int i = 0; i < group_count; i++)
+        {
+                timed_group_starts[i] = 0;
         }
-
-        return commands_count + (set_pointer ? 0 : 1);
 }
 
 
-// BUILT IN HANDLERS
-
-void handle_cd(char **args)
+// time_group - & group starts now
+void time_group(int group)
 {
-        int res = chdir(*(args+1));
-        if (res == -1)
+        if (timing)
         {
-                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                return;
+                timed_group_starts[group] = metrics_now();
         }
 }
 
 
-void handle_exit(char **args, char* input)
+// time_label - the words of argv and then suffix, as one string in the line's arena (NULL if not timing)
+char* time_label(char** argv, const char* suffix)
 {
-        // since we got rid of any spaces, any existence of non space character must be at the second arg
-        char *second_arg = args[1];
-        if (second_arg != NULL)
+        if (!timing)
         {
-                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                return NULL;
         }
-
-        free_args_elements(args);
-        free(args);
-
-        free_search_paths();
-
-        free(input);
-        exit(0);
+        size_t length = strlen(suffix) + 1;
+        for (int i = 0; argv[i] != NULL; i++)
+        {
+                length += strlen(argv[i]) + 1;
+        }
+        char* label = arena_alloc(line_arena, length);
+        label[0] = '\0';
+        for (int i = 0; argv[i] != NULL; i++)
+        {
+                strcat(label, i > 0 ? " " : "");
+                strcat(label, argv[i]);
+        }
+        strcat(label, suffix);
+        return label;
 }
 
 
-// handle_path - adds path into the global search_paths array
-void handle_path(char **args)
+// time_process - adds a row for something that started just now. Returns the row, -1 if the line isn't timed.
+int time_process(pid_t pid, int group, int stage, const char* label)
 {
-        int count = 0;
-        int index = 1;
-        free_search_paths();
-        while (args[index] != NULL)
+        if (!timing)
         {
-                add_path(search_paths, count, args[index]);
-                index++;
-                count++;
+                return -1;
         }
-        // Even if path has no arguments, we clear the search paths
-        search_paths[count] = NULL;                     // Note: empty search_paths[i] starts 0x0
+        grow_array((void**) &timed_processes, &timed_capacity, timed_count, sizeof(struct TimedProcess));
+        timed_processes[timed_count] = (struct TimedProcess){.pid = pid, .group = group, .stage = stage,
+                .label = label, .started = metrics_now()};                        // ended and usage start at 0
+        return timed_count++;
 }
 
 
-// add_path - adds path to current available search_paths global array
-void add_path(char** search_paths, int index, const char* path)
+// time_in_shell - adds a row for a builtin or copy about to run in the shell, started with the shell's usage so far
+int time_in_shell(int group, struct Stage* stage, const char* kind)
 {
-        search_paths[index] = malloc(strlen(path) + 2);
-        if (search_paths[index] == NULL) {
-                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                exit(1);
+        int row = time_process(-1, group, 0, time_label(stage->argv, kind));
+        if (row != -1)
+        {
+                getrusage(RUSAGE_SELF, &timed_processes[row].usage);
         }
-        strcpy(search_paths[index], path);
-        strcat(search_paths[index], "/");
+        return row;
 }
 
 
-void free_search_paths()
+// time_in_shell_done - the builtin or copy of row is done: its usage is what the shell used since it started
+void time_in_shell_done(int row)
 {
-        for (int i = 0; search_paths[i] != NULL; i++)
+        if (row == -1)
         {
-                free(search_paths[i]);
+                return;
         }
+        struct rusage before = timed_processes[row].usage;
+        struct rusage now;
+        getrusage(RUSAGE_SELF, &now);
+        timersub(&now.ru_utime, &before.ru_utime, &now.ru_utime);
+        timersub(&now.ru_stime, &before.ru_stime, &now.ru_stime);
+        now.ru_nvcsw -= before.ru_nvcsw;
+        now.ru_nivcsw -= before.ru_nivcsw;
+        time_finished(row, &now);
 }
 
 
-void add_bin_path_automatically()
+// time_finished - row is done, with usage
+void time_finished(int row, struct rusage* usage)
 {
-    add_path(search_paths, 0, "/bin");
-    add_path(search_paths, 1, "/usr/bin");
-    add_path(search_paths, 2, "/sbin");
-    search_paths[3] = NULL;
+        if (!timing || row == -1)
+        {
+                return;
+        }
+        timed_processes[row].ended = metrics_now();
+        timed_processes[row].usage = *usage;
 }
 
 
-// select_search_path - creates a valid path out of search_paths (current available paths) for name (program name)
-// E.g. "/bin/" works with name="ls"
-// This will set the path mem block to be a valid path for executing the program name.
-void select_search_path(char *path, char* name)
+// time_reaped - pid was reaped with usage: finishes its row, if it has one
+void time_reaped(pid_t pid, struct rusage* usage)
 {
-        int count = 0;
-        char temp[100] = {0};
-        while (search_paths[count] != NULL)
+        for (int i = 0; timing && i < timed_count; i++)
         {
-                strcpy(temp, search_paths[count]);
-                strcat(temp, name);
-                
-                if (access(temp, X_OK) == 0)
+                if (timed_processes[i].pid == pid && timed_processes[i].ended == 0)
                 {
-                        strcpy(path, temp);
+                        time_finished(i, usage);
                         return;
                 }
-                count++;
         }
+}
+
+
+// add_usage - adds usage into total: CPU time and context switches sum up, max RSS is the largest
+void add_usage(struct rusage* total, struct rusage* usage)
+{
+        timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+        total->ru_maxrss = usage->ru_maxrss > total->ru_maxrss ? usage->ru_maxrss : total->ru_maxrss;
+        total->ru_nvcsw += usage->ru_nvcsw;
+        total->ru_nivcsw += usage->ru_nivcsw;
+}
+
 
+// print_time_row - one line of the report
+void print_time_row(const char* group, const char* stage, const char* label, double real, struct rusage* usage)
+{
+        dprintf(STDERR_FILENO, "%-6s%-6s%-36.36s %8.3fs %8.3fs %8.3fs %9ld KB %8ld %8ld\n", group, stage, label, real,
+                usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6, usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
 }
 
 
-// free_args_elements - frees nested's strings, not nested itself
-void free_args_elements(char** nested)
+// report_timing - prints the timed line's rows, a total per & group that has more than one, and the line's total
+void report_timing()
 {
-        for (int i = 0; i < number_of_args; i++) {
-                if (nested[i] != NULL) {
-                    free(nested[i]);
+        if (!timing)
+        {
+                return;
+        }
+        timing = 0;
+        double now = metrics_now();
+        dprintf(STDERR_FILENO, "%-6s%-6s%-36s %9s %9s %9s %12s %8s %8s\n", "group", "stage", "command", "real", "user", "sys",
+                "max rss", "vol cs", "invol cs");
+        struct rusage line_usage = {0};
+        for (int group = 0; group < timed_group_count; group++)
+        {
+                struct rusage group_usage = {0};
+                double group_ended = timed_group_starts[group];
+                int rows = 0;
+                char group_name[16];
+                snprintf(group_name, sizeof(group_name), "%d", group + 1);
+                for (int i = 0; i < timed_count; i++)
+                {
+                        struct TimedProcess* timed = &timed_processes[i];
+                        if (timed->group != group)
+                        {
+                                continue;
+                        }
+                        double ended = timed->ended != 0 ? timed->ended : now;  // Case: never reaped (e.g. no children left to wait for)
+                        char stage_name[16];
+                        snprintf(stage_name, sizeof(stage_name), "%d", timed->stage + 1);
+                        print_time_row(group_name, stage_name, timed->label, ended - timed->started, &timed->usage);
+                        add_usage(&group_usage, &timed->usage);
+                        group_ended = ended > group_ended ? ended : group_ended;
+                        rows++;
+                }
+                if (rows > 1)
+                {
+                        print_time_row(group_name, "", "(group)", group_ended - timed_group_starts[group], &group_usage);
                 }
+                add_usage(&line_usage, &group_usage);
         }
+        print_time_row("", "", "(line)", now - timing_started, &line_usage);
 }
 
 
-// TODO: Duplicated redirection checking functionality in exec_piped_command
-// execute_piped_command - executes the piped-command described in args e.g. {"ls", "|", "wc", ">", "output.txt", "|", "wc"}
-// Precondition: that args is already well parsed, meaning that any meaningful symbol is separated as an individual item.
-// This should be used when any chain of command has a | operator in it.
-void execute_piped_command(char **args)
+////// BENCH
+
+// bench [-n N] [-w W] [--] LINE runs LINE W times to warm up (the command hash, the page cache, the arena's blocks),
+// then N times to measure, all inside the running shell, so none of the shell's own startup is in the numbers.
+// bench is a prefix of the line like time, taken off by link_command_line, and launch_line hands such a line to
+// run_bench instead of running it. Each run parses a fresh copy of the line's text into an arena of its own and goes
+// through launch_line and wait_line like a line of a script, one after the other, so every run sets up and leaves
+// the line state (last_status, the job counts, collation, timing) the way any line does.
+// It prints the min, p50, p90, p99, max, mean and standard deviation of every phase: parse (parse_line), launch
+// (launch_line: lookups, pipes and spawns), wait (wait_line: until everything it started is reaped) and the whole run.
+
+enum BenchPhase { BENCH_PARSE, BENCH_LAUNCH, BENCH_WAIT, BENCH_TOTAL, BENCH_PHASES };
+const char* bench_phase_names[] = {"parse", "launch", "wait", "total"};
+
+
+// parse_bench_prefix - takes "bench [-n N] [-w W] [--]" off the first stage into line->bench_runs / bench_warmup.
+// Returns -1 (and bench_runs is -1) if an option is malformed, N is 0, or N or W is over MAX_BENCH_RUNS.
+int parse_bench_prefix(struct CommandLine* line, struct Stage* first)
 {
-        int pipe_count = 0;
-        for (int i = 0; args[i] != NULL; i++)
+        line->bench_runs = 100;
+        line->bench_warmup = 5;
+        first->argv++;
+        first->argc--;
+        while (first->argc > 0 && first->argv[0][0] == '-')
         {
-                if (strcmp(args[i], "|") == 0)
+                if (strcmp(first->argv[0], "--") == 0)                  // The line itself starts with a -
+                {
+                        first->argv++;
+                        first->argc--;
+                        break;
+                }
+                long* value = strcmp(first->argv[0], "-n") == 0 ? &line->bench_runs : strcmp(first->argv[0], "-w") == 0 ? &line->bench_warmup : NULL;
+                if (value == NULL || first->argc < 2 || (*value = parse_count(first->argv[1])) == -1 || *value > MAX_BENCH_RUNS)
                 {
-                        pipe_count++;
+                        line->bench_runs = -1;
+                        return -1;
                 }
+                first->argv += 2;
+                first->argc -= 2;
+        }
+        if (line->bench_runs == 0)
+        {
+                line->bench_runs = -1;
+                return -1;
         }
+        return 0;
+}
 
-        // a struct that represents a command
-        struct Command {
-                char** command;                 // Command array
-                int need_redirection;           // If there is a file redirection in here
-                int personal_pipe[2];           // Personal pipe for holding redirection
-                char* file_name;                // file to redirect to
-                int pipe_to_read_from;          // pipe to read from
-                int pipe_to_write_to;           // pipe to write to
-        };
 
-        struct Command commands[sizeof(struct Command) * (pipe_count + 1)];
-        int cmd_index = 0;
+// append_text - copies text to p, returns where it ends
+char* append_text(char* p, const char* text)
+{
+        size_t length = strlen(text);
+        memcpy(p, text, length);
+        return p + length;
+}
 
-        commands[0] = (struct Command){args, 0, 0, 0, 0, 0};
 
-        // Divides the command based on the location of the pipe operator
-        for (int i = 0; args[i] != NULL; i++)
+// bench_text - the parsed line as text again, without its bench prefix: what every run parses. In line_arena.
+char* bench_text(struct CommandLine* line)
+{
+        size_t size = sizeof("time ");
+        for (int i = 0; i < line->pipeline_count; i++)
         {
-                if (strcmp(args[i], "|") == 0)
+                size += sizeof(" & ") + sizeof(")");
+                for (int j = 0; j < line->pipelines[i].stage_count; j++)
                 {
-                        free(args[i]);
-                        args[i] = NULL;
-                        commands[++cmd_index] = (struct Command){&args[i + 1], 0, 0, 0, 0, 0};
+                        struct Stage* stage = &line->pipelines[i].stages[j];
+                        size += sizeof(" |+ (");
+                        for (int k = 0; k < stage->argc; k++)
+                        {
+                                size += strlen(stage->argv[k]) + 1;
+                        }
+                        for (int k = 0; k < stage->output_count; k++)
+                        {
+                                size += sizeof(" > ") + strlen(stage->output_files[k]);
+                        }
+                        size += stage->input_file != NULL ? sizeof(" < ") + strlen(stage->input_file) : 0;
                 }
         }
-
-        // Check if there is need for redirection for each command, if so setup necessary pipes for it
-        for (int i = 0; i < pipe_count+1; i++)
+        char* text = arena_alloc(line_arena, size);
+        char* p = line->timed ? append_text(text, "time ") : text;
+        for (int i = 0; i < line->pipeline_count; i++)
         {
-                for (int j = 0; commands[i].command[j] != NULL; j++)            // loop until the command has ended
+                struct Pipeline* pipeline = &line->pipelines[i];
+                int first_consumer = pipeline->stage_count - pipeline->consumer_count;
+                p = append_text(p, i > 0 ? " & " : "");
+                for (int j = 0; j < pipeline->stage_count; j++)
                 {
-                        if (strcmp(commands[i].command[j], ">") == 0)                      // found redirection operator
+                        struct Stage* stage = &pipeline->stages[j];
+                        if (j > 0)
                         {
-                                // Check if there is a file name after the redirection operator
-                                if (commands[i].command[j+1] == NULL)
-                                {
-                                        write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
-                                        exit(1);
-                                }
-
-                                commands[i].need_redirection = 1;
-                                commands[i].file_name = strdup(commands[i].command[j+1]);               // Get file name
-                                pipe(commands[i].personal_pipe);                                        // setup pipe of struct
-                                
-                                // Set the command to break here (And free the symbol and the filename)
-                                free(commands[i].command[j]);
-                                commands[i].command[j] = NULL;
-                                break;
+                                p = append_text(p, pipeline->consumer_count == 0 ? " | " : j == first_consumer ? " |+ (" : j > first_consumer ? ", " : " | ");
+                        }
+                        for (int k = 0; k < stage->argc; k++)
+                        {
+                                p = append_text(p, k > 0 ? " " : "");
+                                p = append_text(p, stage->argv[k]);
+                        }
+                        if (stage->input_file != NULL)
+                        {
+                                p = append_text(p, " < ");
+                                p = append_text(p, stage->input_file);
+                        }
+                        for (int k = 0; k < stage->output_count; k++)
+                        {
+                                p = append_text(p, " > ");
+                                p = append_text(p, stage->output_files[k]);
                         }
                 }
+                p = append_text(p, pipeline->consumer_count > 0 ? ")" : "");
         }
+        *p = '\0';
+        return text;
+}
 
-        // creates pipes for shared use
-        int pipes[pipe_count][2];
 
-        // Make the pipes
-        for (size_t i = 0; i < pipe_count; i++)
+// run_bench - runs a bench line (see link_command_line) its warmup and measured runs, then prints the phases.
+// last_status is the last run's, or 130 after a Ctrl-C, which stops it with what was measured so far.
+void run_bench(struct CommandLine* line)
+{
+        long runs = line->bench_runs;
+        long warmup = line->bench_warmup;
+        char* text = bench_text(line);
+        size_t length = strlen(text);
+        double* samples = malloc(BENCH_PHASES * runs * sizeof(double));
+        if (samples == NULL)
         {
-                if (pipe(pipes[i]) < 0)
-                {
-                        fprintf(stderr, ERROR_MESSAGE);
-                        exit(1);
-                }
+                write(STDERR_FILENO, ERROR_MESSAGE, strlen(ERROR_MESSAGE));
+                last_status = 1;
+                return;
         }
-        
-        // Setup individual redirection
-        for (int i = 0; i < pipe_count+1; i++)                  // Loop through the commands
+
+        benchmarking = 1;
+        struct Arena* outer_arena = line_arena;
+        long measured = 0;
+        int status = 0;
+        for (long run = 0; run < warmup + runs; run++)
         {
-                if (i < pipe_count)
+                line_arena = &bench_arena;
+                char* input = arena_alloc(line_arena, length + 2);      // Like a line from getline: \n, then \0
+                memcpy(input, text, length);
+                input[length] = '\n';
+                input[length + 1] = '\0';
+                double started = metrics_now();
+                parse_line(input, length + 1, &bench_line);
+                double parsed = metrics_now();
+                launch_line(&bench_line);
+                double launched = metrics_now();
+                wait_line(&bench_line);
+                double waited = metrics_now();
+                arena_reset(line_arena);
+                line_arena = outer_arena;
+                status = last_status;
+                if (line_interrupted)                                   // Ctrl-C: report what was measured so far
                 {
-                        commands[i].pipe_to_write_to = pipes[i][1];     // the current pipe's write end
+                        line_interrupted = 0;                           // The run's wait_line has dealt with it already
+                        status = 128 + SIGINT;
+                        break;
                 }
-                if (i > 0)
+                if (run >= warmup)
                 {
-                        commands[i].pipe_to_read_from = pipes[i-1][0];  // the previous pipe's read end
+                        samples[BENCH_PARSE * runs + measured] = parsed - started;
+                        samples[BENCH_LAUNCH * runs + measured] = launched - parsed;
+                        samples[BENCH_WAIT * runs + measured] = waited - launched;
+                        samples[BENCH_TOTAL * runs + measured] = waited - started;
+                        measured++;
                 }
-                // Each command should write to its corresponding pipe, except for the last one
         }
-        commands[0].pipe_to_read_from = dup(STDIN_FILENO);
-        commands[pipe_count].pipe_to_write_to = dup(STDOUT_FILENO);
-
+        benchmarking = 0;
+        start_collation(0);                                             // The last run's went with bench_arena
 
-        // Calling now
-        for (int i = 0; i < pipe_count+1; i++)
+        dprintf(STDOUT_FILENO, "%ld runs (%ld warmup): %s\n", measured, warmup, text);
+        if (measured > 0)
         {
-                struct Command current_command = commands[i];
-                if (current_command.need_redirection)
+                dprintf(STDOUT_FILENO, "%-8s%10s%10s%10s%10s%10s%10s%10s\n", "", "min", "p50", "p90", "p99", "max", "mean", "stddev");
+        }
+        for (int phase = 0; phase < BENCH_PHASES && measured > 0; phase++)
+        {
+                double* values = &samples[phase * runs];
+                qsort(values, measured, sizeof(double), compare_samples);
+                double sum = 0;
+                for (long j = 0; j < measured; j++)
                 {
-                        char buffer[MAX_REDIRECTED_OUTPUT];
-                        int bytes_read;
-                        
-                        int file_fd = open(current_command.file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                        
-                        pid_t child = fork();
-                        if (child < 0)
-                        {
-                                fprintf(stderr, "FORK FAILED");
-                                return;
-                        }
-                        else if (child == 0)
-                        {
-                                dup2(current_command.pipe_to_read_from, STDIN_FILENO);
-                                close(current_command.pipe_to_read_from);
-                                close(current_command.personal_pipe[0]);
-                                dup2(current_command.personal_pipe[1], STDOUT_FILENO);
-                                close(current_command.personal_pipe[1]);
+                        sum += values[j];
+                }
+                double mean = sum / measured;
+                double squares = 0;
+                for (long j = 0; j < measured; j++)
+                {
+                        squares += (values[j] - mean) * (values[j] - mean);
+                }
+                double statistics[7] = {values[0], percentile(values, measured, 50), percentile(values, measured, 90),
+                                        percentile(values, measured, 99), values[measured - 1], mean, square_root(squares / measured)};
+                char row[128];
+                int used = snprintf(row, sizeof(row), "%-8s", bench_phase_names[phase]);
+                for (int j = 0; j < 7; j++)
+                {
+                        char duration[16];
+                        format_duration(statistics[j], duration, sizeof(duration));
+                        used += snprintf(row + used, sizeof(row) - used, "%10s", duration);
+                }
+                dprintf(STDOUT_FILENO, "%s\n", row);
+        }
+        free(samples);
+        last_status = status;
+}
 
-                                char path[CONCAT_PATH_MAX] = {0};
-                                select_search_path(path, current_command.command[0]);
 
-                                execv(path, current_command.command);
-                                exit(1);
-                        }
+// compare_samples - qsort order of two durations
+int compare_samples(const void* a, const void* b)
+{
+        double x = *(const double*) a;
+        double y = *(const double*) b;
+        return (x > y) - (x < y);
+}
 
-                        close(current_command.personal_pipe[1]);
 
-                        while ((bytes_read = read(current_command.personal_pipe[0], 
-                                buffer, 
-                                sizeof(buffer))))
-                        {
-                                write(file_fd, buffer, bytes_read);
-                                write(current_command.pipe_to_write_to, buffer, bytes_read);
-                        }
-                        close(current_command.pipe_to_write_to);
-                        close(current_command.personal_pipe[0]);
-                }
-                else    // No redirection, (personal_pipe is 0, file_name is 0)
-                {
-                        pid_t child = fork();
-                        if (child < 0)
-                        {
-                                fprintf(stderr, "FORK FAILED");
-                                return;
-                        }
-                        else if (child == 0)
-                        {
-                                dup2(current_command.pipe_to_read_from, STDIN_FILENO);
-                                close(current_command.pipe_to_read_from);
-                                dup2(current_command.pipe_to_write_to, STDOUT_FILENO);
-                                close(current_command.pipe_to_write_to);
+// percentile - the nearest-rank p-th percentile of count sorted values
+double percentile(double* sorted, long count, int p)
+{
+        long rank = (p * count + 99) / 100;                             // ceil(p / 100 * count), 1 based
+        return sorted[rank > 0 ? rank - 1 : 0];
+}
 
-                                char path[CONCAT_PATH_MAX] = {0};
-                                select_search_path(path, current_command.command[0]);
 
-                                execv(path, current_command.command);
-                                exit(1);
-                        }
+// square_root - Newton's method, so the shell still builds with a plain gcc shell.c (no -lm)
+double square_root(double value)
+{
+        if (value <= 0)
+        {
+                return 0;
+        }
+        double root = value > 1 ? value : 1;                            // From above, it only comes down
+        for (int i = 0; i < 64; i++)
+        {
+                root = (root + value / root) / 2;
+        }
+        return root;
+}
 
-                }
-                // Wait for child to complete, then close the pipes that this child needed
-                wait(NULL);
-                close(current_command.pipe_to_read_from);
-                close(current_command.pipe_to_write_to);
+
+// format_duration - seconds as ns, us, ms or s, with 3 significant digits or more
+void format_duration(double seconds, char* text, size_t size)
+{
+        if (seconds < 1e-6)
+        {
+                snprintf(text, size, "%.0fns", seconds * 1e9);
         }
-        for (int i = 0; i < pipe_count+1; i++)
+        else if (seconds < 1e-3)
         {
-                if (commands[i].file_name) 
-                {
-                        free(commands[i].file_name);
-                }
+                snprintf(text, size, "%.2fus", seconds * 1e6);
+        }
+        else if (seconds < 1)
+        {
+                snprintf(text, size, "%.2fms", seconds * 1e3);
+        }
+        else
+        {
+                snprintf(text, size, "%.3fs", seconds);
         }
 }